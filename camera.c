@@ -0,0 +1,221 @@
+#include "camera.h"
+#include "downlink_queue.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Two stage pipeline so the serial loop never waits on the camera:
+ *   capture thread: sleeps until the earliest requested time, grabs a raw frame
+ *   encode thread:  downscales the frame and writes it out as a photo
+ * Raw frames come from a fixed pool, so a burst of captures is throttled
+ * by the encoder instead of growing memory.
+ */
+
+typedef struct {
+    Frame    frame;
+    // When the frame was actually grabbed, in unix milliseconds
+    uint64_t captured;
+} Capture;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    const CameraBackend *backend;
+
+    // Requested capture times, kept sorted earliest first
+    uint64_t requests[PHOTO_REQUESTS];
+    size_t   requestCount;
+
+    // Frames are either free or waiting to be encoded
+    Capture  captures[CAMERA_FRAMES];
+    Capture *free[CAMERA_FRAMES];
+    size_t   freeCount;
+    Capture *encode[CAMERA_FRAMES];
+    size_t   encodeCount;
+} cam = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER
+};
+
+static uint64_t unixTime()
+{
+    return time(NULL);
+}
+
+static uint64_t unixTimeMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *captureThread(void *arg)
+{
+    pthread_mutex_lock(&cam.lock);
+    while (true) {
+        if (cam.requestCount == 0 || cam.freeCount == 0) {
+            pthread_cond_wait(&cam.changed, &cam.lock);
+            continue;
+        }
+
+        // Sleep until the earliest capture, or until an earlier one gets scheduled
+        if (cam.requests[0] > unixTime()) {
+            struct timespec deadline = { .tv_sec = cam.requests[0] };
+            pthread_cond_timedwait(&cam.changed, &cam.lock, &deadline);
+            continue;
+        }
+
+        uint64_t time = cam.requests[0];
+        memmove(cam.requests, cam.requests + 1, --cam.requestCount * sizeof(uint64_t));
+        Capture *c = cam.free[--cam.freeCount];
+        pthread_mutex_unlock(&cam.lock);
+
+        int result = cam.backend->capture(&c->frame);
+        c->captured = unixTimeMs();
+
+        pthread_mutex_lock(&cam.lock);
+        if (result == -1) {
+            fprintf(stderr, "Error capturing photo for %llu\n", (unsigned long long) time);
+            cam.free[cam.freeCount++] = c;
+        } else {
+            cam.encode[cam.encodeCount++] = c;
+        }
+        pthread_cond_broadcast(&cam.changed);
+    }
+
+    return NULL;
+}
+
+// Halve the frame in both directions by averaging 2x2 blocks
+static void downscale(const Frame *in, Frame *out)
+{
+    out->width = in->width / 2;
+    out->height = in->height / 2;
+
+    for (uint32_t y = 0; y < out->height; ++y) {
+        const uint8_t *row0 = in->data + 2 * y * in->width;
+        const uint8_t *row1 = row0 + in->width;
+        uint8_t *dst = out->data + y * out->width;
+        for (uint32_t x = 0; x < out->width; ++x)
+            dst[x] = (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) / 4;
+    }
+}
+
+// Write a binary pgm named for its capture time, then rename it into place and queue it for download
+static int writePhoto(const Frame *frame, uint64_t captured)
+{
+    char path[64], tmp[sizeof(path) + 5];
+    snprintf(path, sizeof(path), PHOTO_DIR "/%llu.pgm", (unsigned long long) captured);
+    snprintf(tmp, sizeof(tmp), "%s.part", path);
+
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL)
+        return -1;
+
+    fprintf(fp, "P5\n%u %u\n255\n", frame->width, frame->height);
+    size_t len = (size_t) frame->width * frame->height;
+    if (fwrite(frame->data, 1, len, fp) != len) {
+        fclose(fp);
+        remove(tmp);
+        return -1;
+    }
+
+    if (fclose(fp) == EOF || rename(tmp, path) == -1) {
+        remove(tmp);
+        return -1;
+    }
+
+    return downlinkPush(path, PHOTO_PRIORITY, 0, 0);
+}
+
+static void *encodeThread(void *arg)
+{
+    Frame scaled;
+    scaled.data = malloc(CAMERA_WIDTH / 2 * CAMERA_HEIGHT / 2);
+
+    pthread_mutex_lock(&cam.lock);
+    while (true) {
+        if (cam.encodeCount == 0) {
+            pthread_cond_wait(&cam.changed, &cam.lock);
+            continue;
+        }
+
+        Capture *c = cam.encode[0];
+        memmove(cam.encode, cam.encode + 1, --cam.encodeCount * sizeof(Capture *));
+        pthread_mutex_unlock(&cam.lock);
+
+        downscale(&c->frame, &scaled);
+        if (writePhoto(&scaled, c->captured) == -1)
+            fprintf(stderr, "Error writing or queueing photo %llu\n", (unsigned long long) c->captured);
+
+        pthread_mutex_lock(&cam.lock);
+        cam.free[cam.freeCount++] = c;
+        pthread_cond_broadcast(&cam.changed);
+    }
+
+    return NULL;
+}
+
+int cameraStart(const CameraBackend *backend)
+{
+    if (mkdir(PHOTO_DIR, 0755) == -1 && errno != EEXIST) {
+        perror("Error creating photo directory");
+        return -1;
+    }
+
+    if (backend->open() == -1) {
+        fprintf(stderr, "Error opening %s camera\n", backend->name);
+        return -1;
+    }
+
+    cam.backend = backend;
+    for (size_t i = 0; i < CAMERA_FRAMES; ++i) {
+        cam.captures[i].frame.width = CAMERA_WIDTH;
+        cam.captures[i].frame.height = CAMERA_HEIGHT;
+        cam.captures[i].frame.data = malloc(CAMERA_WIDTH * CAMERA_HEIGHT);
+        cam.free[i] = &cam.captures[i];
+    }
+    cam.freeCount = CAMERA_FRAMES;
+
+    pthread_t capture, encode;
+    if (pthread_create(&capture, NULL, captureThread, NULL) != 0
+        || pthread_create(&encode, NULL, encodeThread, NULL) != 0) {
+        perror("Error creating camera threads");
+        return -1;
+    }
+    pthread_detach(capture);
+    pthread_detach(encode);
+
+    return 0;
+}
+
+int cameraSchedule(uint64_t time)
+{
+    pthread_mutex_lock(&cam.lock);
+    if (cam.requestCount == PHOTO_REQUESTS) {
+        pthread_mutex_unlock(&cam.lock);
+        return -1;
+    }
+
+    size_t i = cam.requestCount;
+    while (i > 0 && cam.requests[i - 1] > time) {
+        cam.requests[i] = cam.requests[i - 1];
+        --i;
+    }
+    cam.requests[i] = time;
+    ++cam.requestCount;
+
+    pthread_cond_broadcast(&cam.changed);
+    pthread_mutex_unlock(&cam.lock);
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef camera_h_INCLUDED
+#define camera_h_INCLUDED
+
+#include <stdint.h>
+
+#define CAMERA_DEVICE "/dev/video0"
+#define CAMERA_WIDTH  1280
+#define CAMERA_HEIGHT 720
+
+// Finished photos are written here, and queued for download at PHOTO_PRIORITY
+#define PHOTO_DIR "photos"
+
+// Bounds on memory use: captures waiting for their time, and raw frames in flight
+#define PHOTO_REQUESTS 16
+#define CAMERA_FRAMES  3
+
+// 8 bit greyscale image
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint8_t *data;
+} Frame;
+
+// A source of frames, capture fills a CAMERA_WIDTH * CAMERA_HEIGHT frame
+typedef struct {
+    const char *name;
+    int  (*open)(void);
+    int  (*capture)(Frame *frame);
+    void (*close)(void);
+} CameraBackend;
+
+extern const CameraBackend v4l2Camera;
+extern const CameraBackend syntheticCamera;
+
+// Start the capture and encode threads on the given backend
+int cameraStart(const CameraBackend *backend);
+
+// Queue a capture for the given unix time, returns -1 if too many are already waiting
+int cameraSchedule(uint64_t time);
+
+#endif // camera_h_INCLUDED
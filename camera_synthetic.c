@@ -0,0 +1,33 @@
+#include "camera.h"
+
+// Test pattern source for running the photo pipeline without a camera attached
+// Every frame is a diagonal gradient shifted by the frame number
+
+static uint32_t frameNumber;
+
+static int syntheticOpen(void)
+{
+    frameNumber = 0;
+    return 0;
+}
+
+static int syntheticCapture(Frame *frame)
+{
+    for (uint32_t y = 0; y < frame->height; ++y) {
+        for (uint32_t x = 0; x < frame->width; ++x)
+            frame->data[y * frame->width + x] = x + y + frameNumber;
+    }
+    ++frameNumber;
+    return 0;
+}
+
+static void syntheticClose(void)
+{
+}
+
+const CameraBackend syntheticCamera = {
+    "synthetic",
+    syntheticOpen,
+    syntheticCapture,
+    syntheticClose
+};
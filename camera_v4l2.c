@@ -0,0 +1,161 @@
+#include "camera.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// V4L2 capture of YUYV frames through mmap'd driver buffers, only the luma is kept
+
+#define V4L2_BUFFERS 2
+
+static int fd = -1;
+static struct {
+    void  *start;
+    size_t length;
+} buffers[V4L2_BUFFERS];
+
+static int xioctl(int request, void *arg)
+{
+    int result;
+    do {
+        result = ioctl(fd, request, arg);
+    } while (result == -1 && errno == EINTR);
+    return result;
+}
+
+static void v4l2Close(void)
+{
+    if (fd < 0)
+        return;
+
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    xioctl(VIDIOC_STREAMOFF, &type);
+
+    for (size_t i = 0; i < V4L2_BUFFERS; ++i) {
+        if (buffers[i].start != NULL)
+            munmap(buffers[i].start, buffers[i].length);
+        buffers[i].start = NULL;
+    }
+
+    close(fd);
+    fd = -1;
+}
+
+static int v4l2Open(void)
+{
+    fd = open(CAMERA_DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("Error opening " CAMERA_DEVICE);
+        return -1;
+    }
+
+    struct v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = CAMERA_WIDTH;
+    fmt.fmt.pix.height = CAMERA_HEIGHT;
+    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (xioctl(VIDIOC_S_FMT, &fmt) == -1
+        || fmt.fmt.pix.width != CAMERA_WIDTH || fmt.fmt.pix.height != CAMERA_HEIGHT
+        || fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV) {
+        fprintf(stderr, "Camera doesn't support %ux%u YUYV\n", CAMERA_WIDTH, CAMERA_HEIGHT);
+        v4l2Close();
+        return -1;
+    }
+
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.count = V4L2_BUFFERS;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(VIDIOC_REQBUFS, &req) == -1 || req.count < V4L2_BUFFERS) {
+        perror("Error requesting camera buffers");
+        v4l2Close();
+        return -1;
+    }
+
+    for (size_t i = 0; i < V4L2_BUFFERS; ++i) {
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (xioctl(VIDIOC_QUERYBUF, &buf) == -1) {
+            perror("Error querying camera buffer");
+            v4l2Close();
+            return -1;
+        }
+
+        buffers[i].length = buf.length;
+        buffers[i].start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
+        if (buffers[i].start == MAP_FAILED) {
+            buffers[i].start = NULL;
+            perror("Error mapping camera buffer");
+            v4l2Close();
+            return -1;
+        }
+
+        if (xioctl(VIDIOC_QBUF, &buf) == -1) {
+            perror("Error queueing camera buffer");
+            v4l2Close();
+            return -1;
+        }
+    }
+
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(VIDIOC_STREAMON, &type) == -1) {
+        perror("Error starting camera stream");
+        v4l2Close();
+        return -1;
+    }
+
+    return 0;
+}
+
+static int v4l2Capture(Frame *frame)
+{
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+
+    // The stream runs continuously, so drop the frames already sitting in the driver's
+    // buffers and keep the next one to get an image from the requested time
+    for (size_t i = 0; i <= V4L2_BUFFERS; ++i) {
+        if (xioctl(VIDIOC_DQBUF, &buf) == -1) {
+            perror("Error dequeueing camera frame");
+            return -1;
+        }
+        if (i < V4L2_BUFFERS && xioctl(VIDIOC_QBUF, &buf) == -1) {
+            perror("Error queueing camera buffer");
+            return -1;
+        }
+    }
+
+    // YUYV has a luma byte in every other position
+    const uint8_t *yuyv = buffers[buf.index].start;
+    size_t pixels = (size_t) frame->width * frame->height;
+    for (size_t i = 0; i < pixels; ++i)
+        frame->data[i] = yuyv[2 * i];
+
+    if (xioctl(VIDIOC_QBUF, &buf) == -1) {
+        perror("Error queueing camera buffer");
+        return -1;
+    }
+
+    return 0;
+}
+
+const CameraBackend v4l2Camera = {
+    "v4l2",
+    v4l2Open,
+    v4l2Capture,
+    v4l2Close
+};
@@ -1,17 +1,56 @@
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include "camera.h"
+#include "content_store.h"
+#include "downlink_queue.h"
+#include "file_utils.h"
+#include "links.h"
+#include "packet_size.h"
+#include "prefetch.h"
+#include "scheduler.h"
+#include "sha256_tree.h"
 #include "sha256_utils.h"
+#include "sha_cache.h"
+#include "sparse.h"
+#include "writebehind.h"
 #include "commands.h"
 
 #define DOWNLOAD_FILEPATH   "download-filepath"
 #define DOWNLOAD_FILEOFFSET "download-fileoffset"
+#define DOWNLOAD_LEAFHASHES "download-leafhashes"
+#define DOWNLOAD_QUEUED     "download-queued"
 
 #define UPLOAD_FILEMETA  "upload-filemeta"
 #define UPLOAD_RECEIVED  "upload-received"
 
+// Entry layout returned by the getdents64 syscall, which glibc has no wrapper struct for
+struct linux_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+// Bytes of packet data left to send this pass
+static uint64_t passBudget = UINT64_MAX;
+
+// Which zeros of a download are sent as zero ranges, see sparse.h
+static uint8_t sparseMode = SPARSE_OFF;
+
+#ifndef CAMERA_BACKEND
+#define CAMERA_BACKEND v4l2Camera
+#endif
+
 long fileLength(FILE *fp)
 {
     if (fseek(fp, 0, SEEK_END) == -1) {
@@ -42,6 +81,31 @@ uint8_t* readFile(FILE *fp, size_t *size)
     return data;
 }
 
+// Stop reading ahead and remove the download metadata
+// The optional files only exist for tree and queued downloads
+static int clearDownload(void)
+{
+    prefetchStop();
+
+    if (remove(DOWNLOAD_FILEPATH) == -1) {
+        perror("remove");
+        return -1;
+    }
+    if (remove(DOWNLOAD_FILEOFFSET) == -1) {
+        perror("remove");
+        return -1;
+    }
+    if (remove(DOWNLOAD_LEAFHASHES) == -1 && errno != ENOENT) {
+        perror("remove");
+        return -1;
+    }
+    if (remove(DOWNLOAD_QUEUED) == -1 && errno != ENOENT) {
+        perror("remove");
+        return -1;
+    }
+    return 0;
+}
+
 // Poweroff Payload
 Message poweroff(const uint8_t *buf, size_t buflen)
 {
@@ -53,8 +117,9 @@ Message poweroff(const uint8_t *buf, size_t buflen)
 }
 
 // Create data for sending a file and return file shasum
+// In tree mode the returned sum is the tree hash root, and the leaf sums are kept for requestPacket
 // TODO: maybe require paths to be absolute?
-Message startDownload(const uint8_t *buf, size_t buflen)
+static Message beginDownload(const uint8_t *buf, size_t buflen, bool tree, uint64_t offset)
 {
     if (buflen == 0)
         return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
@@ -84,22 +149,69 @@ Message startDownload(const uint8_t *buf, size_t buflen)
         return EMPTY_MESSAGE(ERROR_OPENING_FILE);
     }
 
-    size_t fileLen;
-    uint8_t *fileData;
-
-    fileData = readFile(fp, &fileLen);
-    if (fileData == NULL) {
+    struct stat st;
+    if (fstat(fileno(fp), &st) == -1) {
         free(path);
         fclose(fp);
         return EMPTY_MESSAGE(ERROR_READING_FILE);
     }
 
-    fclose(fp);
-
     uint8_t shaSum[32];
-    sha256calc(fileData, fileLen, shaSum);
+    if (tree) {
+        size_t fileLen;
+        uint8_t *fileData;
+
+        fileData = readFile(fp, &fileLen);
+        if (fileData == NULL) {
+            free(path);
+            fclose(fp);
+            return EMPTY_MESSAGE(ERROR_READING_FILE);
+        }
 
-    free(fileData);
+        size_t leafCount = sha256treeLeafCount(fileLen, PACKET_SIZE);
+        uint8_t (*leaves)[32] = malloc(leafCount * 32);
+        sha256tree(fileData, fileLen, PACKET_SIZE, 0, shaSum, leaves);
+
+        free(fileData);
+
+        FILE *downLeaves = fopen(DOWNLOAD_LEAFHASHES, "w");
+        if (downLeaves == NULL) {
+            free(path);
+            free(leaves);
+            fclose(fp);
+            return EMPTY_MESSAGE(ERROR_OPENING_FILE);
+        }
+
+        if (fwrite(leaves, 32, leafCount, downLeaves) != leafCount) {
+            free(path);
+            free(leaves);
+            fclose(fp);
+            fclose(downLeaves);
+            remove(DOWNLOAD_LEAFHASHES);
+            return EMPTY_MESSAGE(ERROR_WRITING_FILE);
+        }
+
+        free(leaves);
+        fclose(downLeaves);
+    } else if (!shaCacheLookup(&st, shaSum)) {
+        // Only hash the file if it changed since it was last hashed
+        size_t fileLen;
+        uint8_t *fileData;
+
+        fileData = readFile(fp, &fileLen);
+        if (fileData == NULL) {
+            free(path);
+            fclose(fp);
+            return EMPTY_MESSAGE(ERROR_READING_FILE);
+        }
+
+        sha256calc(fileData, fileLen, shaSum);
+        shaCacheStore(&st, shaSum);
+
+        free(fileData);
+    }
+
+    fclose(fp);
 
     // Create file transfer metadata files
     // Open both download meta and download packet number, but if either don't open, io error
@@ -118,7 +230,7 @@ Message startDownload(const uint8_t *buf, size_t buflen)
         return EMPTY_MESSAGE(ERROR_OPENING_FILE);
     }
 
-    // write path to downMeta and zero to downPacket
+    // write path to downMeta and the starting offset to downOffset
     if (fputs(path, downMeta) == EOF) {
         free(path);
         fclose(downMeta);
@@ -126,9 +238,11 @@ Message startDownload(const uint8_t *buf, size_t buflen)
         return EMPTY_MESSAGE(ERROR_WRITING_FILE);
     }
 
+    // Start reading ahead while the ground is still handling this reply
+    prefetchStart(path, offset);
+    packetSizeResetStats();
     free(path);
 
-    uint64_t offset = 0;
     if (fwrite(&offset, 8, 1, downOffset) != 1) {
         fclose(downMeta);
         fclose(downOffset);
@@ -152,6 +266,17 @@ Message startDownload(const uint8_t *buf, size_t buflen)
     return m;
 }
 
+Message startDownload(const uint8_t *buf, size_t buflen)
+{
+    return beginDownload(buf, buflen, false, 0);
+}
+
+// Same as startDownload, but every packet is prefixed with its leaf sum
+Message startTreeDownload(const uint8_t *buf, size_t buflen)
+{
+    return beginDownload(buf, buflen, true, 0);
+}
+
 // Create data for receiving a file
 Message startUpload(const uint8_t *buf, size_t buflen)
 {
@@ -165,6 +290,10 @@ Message startUpload(const uint8_t *buf, size_t buflen)
     if (access(UPLOAD_FILEMETA, F_OK) == 0 || access(UPLOAD_RECEIVED, F_OK) == 0)
         return EMPTY_MESSAGE(ERROR_ALREADY_UPLOADING);
 
+    // Drop anything left over from an upload that was finalized
+    writeBehindClose();
+    packetSizeResetStats();
+
     // Open upload meta, upload packet number, and received data file, if either don't return io error
     FILE *upMeta, *upReceived;
 
@@ -188,15 +317,122 @@ Message startUpload(const uint8_t *buf, size_t buflen)
     fclose(upMeta);
     fclose(upReceived);
 
+    // Nothing needs to be sent if the content is already on board, finalizeUpload takes it from the store
+    if (contentStoreHas(buf))
+        return EMPTY_MESSAGE(ALREADY_HAVE);
+
     return EMPTY_MESSAGE(SUCCESS);
 }
 
-// Send a packet to CDH
-Message requestPacket(const uint8_t *buf, size_t buflen)
+// Start the next queued download if nothing is being downloaded, or if the current queued
+// download is large and something more important is waiting
+// Returns true with the reply in m if a download was started or it failed to start
+static bool serveQueue(Message *m)
 {
-    if (buflen != 0)
+    DownlinkEntry next;
+    if (!downlinkPeek(&next))
+        return false;
+
+    bool downloading = access(DOWNLOAD_FILEPATH, F_OK) == 0 || access(DOWNLOAD_FILEOFFSET, F_OK) == 0;
+
+    // A download that can't send its first packet this pass isn't worth starting, or hashing
+    struct stat st;
+    if (stat(next.path, &st) == 0 && st.st_size > next.offset) {
+        uint64_t first = st.st_size - next.offset;
+        if (first > packetSizeCurrent())
+            first = packetSizeCurrent();
+        if (first > passBudget) {
+            if (downloading)
+                return false;
+            *m = EMPTY_MESSAGE(ERROR_BUDGET_EXHAUSTED);
+            return true;
+        }
+    }
+    if (downloading) {
+        // Downloads started by hand are never preempted
+        FILE *downQueued = fopen(DOWNLOAD_QUEUED, "r");
+        if (downQueued == NULL)
+            return false;
+
+        DownlinkEntry current;
+        bool read = fread(&current, sizeof(current), 1, downQueued) == 1;
+        fclose(downQueued);
+        if (!read || next.priority <= current.priority)
+            return false;
+
+        FILE *downOffset = fopen(DOWNLOAD_FILEOFFSET, "r");
+        if (downOffset == NULL)
+            return false;
+        read = fread(&current.offset, 8, 1, downOffset) == 1;
+        fclose(downOffset);
+
+        if (!read || stat(current.path, &st) == -1 || st.st_size - current.offset < DOWNLINK_PREEMPT_BYTES)
+            return false;
+
+        // Put the current download back in the queue to be resumed where it left off
+        printf("Preempting download of %s at %llu\n", current.path, (unsigned long long) current.offset);
+        if (downlinkPush(current.path, current.priority, current.deadline, current.offset) == -1)
+            return false;
+        if (clearDownload() == -1) {
+            *m = EMPTY_MESSAGE(ERROR_REMOVING_FILE);
+            return true;
+        }
+    }
+
+    downlinkPop(&next);
+
+    Message started = beginDownload((const uint8_t *) next.path, strlen(next.path), false, next.offset);
+    if (started.code != SUCCESS) {
+        *m = started;
+        return true;
+    }
+
+    // Remember the entry so the download can be preempted and requeued
+    FILE *downQueued = fopen(DOWNLOAD_QUEUED, "w");
+    if (downQueued == NULL || fwrite(&next, sizeof(next), 1, downQueued) != 1)
+        perror("Error writing " DOWNLOAD_QUEUED);
+    if (downQueued != NULL)
+        fclose(downQueued);
+
+    // download started reply format
+    //   32 bytes for sha256sum
+    //   8 bytes for the offset the following packets start at
+    //   n bytes for path
+
+    size_t pathlen = strlen(next.path);
+
+    m->code = DOWNLOAD_STARTED;
+    m->payloadLen = 40 + pathlen;
+    m->payload = malloc(40 + pathlen);
+
+    memcpy(m->payload, started.payload, 32);
+    memcpy(m->payload + 32, &next.offset, 8);
+    memcpy(m->payload + 40, next.path, pathlen);
+
+    free(started.payload);
+    return true;
+}
+
+// Least room a reply needs to serve a packet, which also covers a DOWNLOAD_STARTED reply
+#define MIN_PACKET_ROOM (8 + 32 + MIN_PACKET_SIZE)
+
+// Serve the next packet of the download, or an earlier one the ground asked for again
+// Striped packets are requested over several links at once, so they carry their offset and a
+// resend of one doesn't rewind the others
+// The reply payload is kept within room bytes, packets in a batch share a frame with other replies
+static Message servePacket(const uint8_t *buf, size_t buflen, bool striped, size_t room)
+{
+    if (buflen != 0 && buflen != 8)
         return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
 
+    if (room < MIN_PACKET_ROOM)
+        return EMPTY_MESSAGE(ERROR_BATCH_TOO_LONG);
+
+    // A resend is for the current download, so it's served before anything can preempt it
+    Message started;
+    if (buflen == 0 && serveQueue(&started))
+        return started;
+
     // check if all the download metadata files exist
     if (access(DOWNLOAD_FILEPATH, F_OK) != 0 || access(DOWNLOAD_FILEOFFSET, F_OK) != 0)
         return EMPTY_MESSAGE(ERROR_NOT_DOWNLOADING);
@@ -243,6 +479,23 @@ Message requestPacket(const uint8_t *buf, size_t buflen)
 
     fclose(downMeta);
 
+    bool tree = access(DOWNLOAD_LEAFHASHES, F_OK) == 0;
+
+    // A resend request means the ground lost the packet, so the packet size backs off
+    bool advance = buflen == 0 || !striped;
+    if (buflen == 8) {
+        uint64_t resend;
+        memcpy(&resend, buf, 8);
+        if (resend > offset || (tree && resend % PACKET_SIZE != 0)) {
+            fclose(downOffset);
+            free(path);
+            return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+        }
+        if (resend < offset)
+            packetSizeLost();
+        offset = resend;
+    }
+
     // Do a sanity check that the file exists
     if (access(path, F_OK) != 0) {
         fclose(downOffset);
@@ -259,59 +512,157 @@ Message requestPacket(const uint8_t *buf, size_t buflen)
         return EMPTY_MESSAGE(ERROR_OPENING_FILE);
     }
 
-    free(path);
-
     // Check that the offset is less than the file length
     long filelen = fileLength(downFile);
     if (filelen == -1) {
         fclose(downOffset);
         fclose(downFile);
+        free(path);
         return EMPTY_MESSAGE(ERROR_SEEKING_FILE);
     }
 
     // If the offset is equal to the file length, the file has been fully transferred
     // remove the download metadata
+    // Striped downloads are kept until they're cancelled, packets lost on other links may still be resent
     if (filelen <= offset) {
         fclose(downOffset);
         fclose(downFile);
-        if (remove(DOWNLOAD_FILEPATH) == -1) {
-            perror("remove");
-            return EMPTY_MESSAGE(ERROR_REMOVING_FILE);
-        }
-        if (remove(DOWNLOAD_FILEOFFSET) == -1) {
-            perror("remove");
+        free(path);
+        if (striped)
+            return EMPTY_MESSAGE(ERROR_DOWNLOAD_OVER);
+        if (clearDownload() == -1)
             return EMPTY_MESSAGE(ERROR_REMOVING_FILE);
-        }
         return EMPTY_MESSAGE(ERROR_DOWNLOAD_OVER);
     }
 
-    // calculate the packet length
-    uint16_t packetlen = filelen - offset > PACKET_SIZE ? PACKET_SIZE : filelen - offset;
+    // Holes and zero runs are sent as their length, the ground fills them back in
+    // Tree downloads send everything since each packet has to match its leaf
+    uint64_t zeros = tree ? 0 : sparseZeroRun(fileno(downFile), offset, filelen, sparseMode);
+    if (zeros > 0) {
+        fclose(downFile);
+        free(path);
 
-    Message m;
-    m.code = SUCCESS;
-    m.payloadLen = packetlen;
-    m.payload = malloc(packetlen);
+        // zero range reply format
+        //   8 bytes for the range's offset (striped packets only)
+        //   8 bytes for the length of the range
+        size_t offsetlen = striped ? 8 : 0;
+
+        Message m;
+        m.code = ZERO_RANGE;
+        m.payloadLen = offsetlen + 8;
+        m.payload = malloc(offsetlen + 8);
+        if (striped)
+            memcpy(m.payload, &offset, 8);
+        memcpy(m.payload + offsetlen, &zeros, 8);
+
+        offset += zeros;
+        rewind(downOffset);
+        if (advance && fwrite(&offset, 8, 1, downOffset) != 1) {
+            fclose(downOffset);
+            free(m.payload);
+            return EMPTY_MESSAGE(ERROR_WRITING_FILE);
+        }
 
-    // Read the next packet data from the file
-    if (fseek(downFile, offset, SEEK_SET) == -1) {
         fclose(downOffset);
-        fclose(downFile);
-        free(m.payload);
-        return EMPTY_MESSAGE(ERROR_SEEKING_FILE);
+        return m;
+    }
+
+    // calculate the packet length, tree downloads stay on PACKET_SIZE so packets line up with leaves
+    uint16_t maxlen = tree ? PACKET_SIZE : packetSizeCurrent();
+    uint16_t packetlen = filelen - offset > maxlen ? maxlen : filelen - offset;
+
+    // packet reply format
+    //   8 bytes for the packet's offset (striped packets only)
+    //   32 bytes for the packet's leaf sum (tree downloads only)
+    //   n bytes for raw data
+    size_t leaflen = (striped ? 8 : 0) + (tree ? 32 : 0);
+
+    // Shorten the packet to the room left, before anything moves, tree packets can't be shortened
+    if (leaflen + packetlen > room) {
+        if (tree) {
+            fclose(downOffset);
+            fclose(downFile);
+            free(path);
+            return EMPTY_MESSAGE(ERROR_BATCH_TOO_LONG);
+        }
+        packetlen = room - leaflen;
     }
 
-    if (fread(m.payload, 1, packetlen, downFile) != packetlen) {
+    if (packetlen > passBudget) {
         fclose(downOffset);
         fclose(downFile);
-        free(m.payload);
-        return EMPTY_MESSAGE(ERROR_READING_FILE);
+        free(path);
+        return EMPTY_MESSAGE(ERROR_BUDGET_EXHAUSTED);
     }
 
+    Message m;
+    m.code = SUCCESS;
+    m.payloadLen = leaflen + packetlen;
+    m.payload = malloc(leaflen + packetlen);
+
+    if (striped)
+        memcpy(m.payload, &offset, 8);
+
+    if (tree) {
+        FILE *downLeaves = fopen(DOWNLOAD_LEAFHASHES, "r");
+        if (downLeaves == NULL) {
+            fclose(downOffset);
+            fclose(downFile);
+            free(path);
+            free(m.payload);
+            return EMPTY_MESSAGE(ERROR_OPENING_FILE);
+        }
+
+        // Packets and leaves are both PACKET_SIZE long, so the offset always lands on a leaf
+        if (fseek(downLeaves, offset / PACKET_SIZE * 32, SEEK_SET) == -1) {
+            fclose(downLeaves);
+            fclose(downOffset);
+            fclose(downFile);
+            free(path);
+            free(m.payload);
+            return EMPTY_MESSAGE(ERROR_SEEKING_FILE);
+        }
+
+        if (fread(m.payload + leaflen - 32, 32, 1, downLeaves) != 1) {
+            fclose(downLeaves);
+            fclose(downOffset);
+            fclose(downFile);
+            free(path);
+            free(m.payload);
+            return EMPTY_MESSAGE(ERROR_READING_FILE);
+        }
+
+        fclose(downLeaves);
+    }
+
+    // Serve the packet data from the read-ahead ring, falling back to reading it here
+    if (!prefetchRead(path, offset, m.payload + leaflen, packetlen)) {
+        if (fseek(downFile, offset, SEEK_SET) == -1) {
+            fclose(downOffset);
+            fclose(downFile);
+            free(path);
+            free(m.payload);
+            return EMPTY_MESSAGE(ERROR_SEEKING_FILE);
+        }
+
+        if (fread(m.payload + leaflen, 1, packetlen, downFile) != packetlen) {
+            fclose(downOffset);
+            fclose(downFile);
+            free(path);
+            free(m.payload);
+            return EMPTY_MESSAGE(ERROR_READING_FILE);
+        }
+    }
+
+    free(path);
+
+    passBudget -= packetlen;
+    packetSizeDelivered(packetlen);
+
     // Update the offset file
     offset += packetlen;
     rewind(downOffset);
-    if (fwrite(&offset, 8, 1, downOffset) != 1) {
+    if (advance && fwrite(&offset, 8, 1, downOffset) != 1) {
         fclose(downOffset);
         fclose(downFile);
         free(m.payload);
@@ -324,6 +675,28 @@ Message requestPacket(const uint8_t *buf, size_t buflen)
     return m;
 }
 
+// Send a packet to CDH
+// When queued downloads are waiting, this may start one instead and reply with DOWNLOAD_STARTED
+Message requestPacket(const uint8_t *buf, size_t buflen)
+{
+    // request packet payload format
+    //   nothing for the next packet, or
+    //   8 bytes for an earlier offset to resend from after a lost packet
+
+    return servePacket(buf, buflen, false, UINT16_MAX);
+}
+
+// Send a packet to CDH, for downloads striped across several links
+// Replies carry the packet's offset so the ground can put the file back together
+Message requestStripe(const uint8_t *buf, size_t buflen)
+{
+    // request stripe payload format
+    //   nothing for the next packet, or
+    //   8 bytes for the offset of a lost packet to resend on its own
+
+    return servePacket(buf, buflen, true, UINT16_MAX);
+}
+
 // Receive a packet from CDH
 Message sendPacket(const uint8_t *buf, size_t buflen)
 {
@@ -337,19 +710,61 @@ Message sendPacket(const uint8_t *buf, size_t buflen)
     if (access(UPLOAD_FILEMETA, F_OK) != 0 || access(UPLOAD_RECEIVED, F_OK) != 0)
         return EMPTY_MESSAGE(ERROR_NOT_UPLOADING);
 
-    FILE *upReceived = fopen(UPLOAD_RECEIVED, "a");
-    if (upReceived == NULL)
-        return EMPTY_MESSAGE(ERROR_OPENING_FILE);
+    // buffer the packet data for the receiving file, it's synced according to the sync policy
+    if (writeBehindAppend(UPLOAD_RECEIVED, buf, buflen) == -1)
+        return errno == ENOENT ? EMPTY_MESSAGE(ERROR_OPENING_FILE) : EMPTY_MESSAGE(ERROR_WRITING_FILE);
 
-    // write packet data to the receiving file
-    if (fwrite(buf, 1, buflen, upReceived) != buflen) {
-        fclose(upReceived);
-        return EMPTY_MESSAGE(ERROR_WRITING_FILE);
-    }
+    // packet success reply format
+    //   8 bytes for the number of bytes received that are on stable storage, a lower bound
+    //   after a restart, RESUME_UPLOAD gives the exact offset to continue from
+    //   2 bytes for the packet size to send next
 
-    fclose(upReceived);
+    Message m;
+    m.code = SUCCESS;
+    m.payloadLen = 10;
+    m.payload = malloc(10);
 
-    return EMPTY_MESSAGE(SUCCESS);
+    uint64_t durable = writeBehindDurable();
+    uint16_t next = packetSizeCurrent();
+    memcpy(m.payload, &durable, 8);
+    memcpy(m.payload + 8, &next, 2);
+
+    return m;
+}
+
+// Tell CDH where to continue an upload from, e.g. after a lost reply or a restart
+// Whatever was received is synced first, so the offset only covers data that's on stable storage
+Message resumeUpload(const uint8_t *buf, size_t buflen)
+{
+    if (buflen != 0 && buflen != 8)
+        return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+
+    // resume upload payload format
+    //   nothing to keep everything received, or
+    //   8 bytes for an offset to cut the received data back to, it's resent from there
+
+    uint64_t limit = UINT64_MAX;
+    if (buflen == 8)
+        memcpy(&limit, buf, 8);
+
+    // check if all the upload metadata files exist
+    if (access(UPLOAD_FILEMETA, F_OK) != 0 || access(UPLOAD_RECEIVED, F_OK) != 0)
+        return EMPTY_MESSAGE(ERROR_NOT_UPLOADING);
+
+    int64_t received = writeBehindResume(UPLOAD_RECEIVED, limit);
+    if (received == -1)
+        return errno == ENOENT ? EMPTY_MESSAGE(ERROR_OPENING_FILE) : EMPTY_MESSAGE(ERROR_WRITING_FILE);
+
+    // resume upload reply format
+    //   8 bytes for the offset the next SEND_PACKET's data goes at
+
+    Message m;
+    m.code = SUCCESS;
+    m.payloadLen = 8;
+    m.payload = malloc(8);
+    memcpy(m.payload, &received, 8);
+
+    return m;
 }
 
 // Erase upload packet data (if any)
@@ -358,6 +773,8 @@ Message cancelUpload(const uint8_t *buf, size_t buflen)
     if (buflen != 0)
         return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
 
+    writeBehindClose();
+
     // Remove the upload files
     if (remove(UPLOAD_FILEMETA) == -1) {
         perror("remove");
@@ -377,14 +794,8 @@ Message cancelDownload(const uint8_t *buf, size_t buflen)
         return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
 
     // Remove the download files
-    if (remove(DOWNLOAD_FILEPATH) == -1) {
-        perror("remove");
+    if (clearDownload() == -1)
         return EMPTY_MESSAGE(ERROR_REMOVING_FILE);
-    }
-    if (remove(DOWNLOAD_FILEOFFSET) == -1) {
-        perror("remove");
-        return EMPTY_MESSAGE(ERROR_REMOVING_FILE);
-    }
     return EMPTY_MESSAGE(SUCCESS);
 }
 
@@ -402,6 +813,11 @@ Message finalizeUpload(const uint8_t *buf, size_t buflen)
     if (access(UPLOAD_FILEMETA, F_OK) != 0 || access(UPLOAD_RECEIVED, F_OK) != 0)
         return EMPTY_MESSAGE(ERROR_NOT_UPLOADING);
 
+    // make sure everything received is on disk before it's checked and moved
+    if (writeBehindSync() == -1)
+        return EMPTY_MESSAGE(ERROR_WRITING_FILE);
+    writeBehindClose();
+
     // open uploading meta files
     FILE *upMeta, *upReceived;
 
@@ -409,9 +825,39 @@ Message finalizeUpload(const uint8_t *buf, size_t buflen)
     if (upMeta == NULL)
         return EMPTY_MESSAGE(ERROR_OPENING_FILE);
 
+    // read in the given shasum
+    uint8_t shaSumGiven[32];
+    if (fread(shaSumGiven, 32, 1, upMeta) != 1) {
+        fclose(upMeta);
+        return EMPTY_MESSAGE(ERROR_READING_FILE);
+    }
+    fclose(upMeta);
+
+    char *path = malloc(buflen + 1);
+    memcpy(path, buf, buflen);
+    path[buflen] = '\0';
+
+    // If nothing was sent because the content was already here, place it from the store
+    struct stat st;
+    if (stat(UPLOAD_RECEIVED, &st) == 0 && st.st_size == 0 && contentStoreHas(shaSumGiven)) {
+        if (contentStorePlace(shaSumGiven, path) == -1) {
+            perror("contentStorePlace");
+            free(path);
+            return EMPTY_MESSAGE(ERROR_RENAMING_FILE);
+        }
+        free(path);
+
+        if (remove(UPLOAD_RECEIVED) == -1 || remove(UPLOAD_FILEMETA) == -1) {
+            perror("remove");
+            return EMPTY_MESSAGE(ERROR_REMOVING_FILE);
+        }
+
+        return EMPTY_MESSAGE(SUCCESS);
+    }
+
     upReceived = fopen(UPLOAD_RECEIVED, "r");
     if (upReceived == NULL) {
-        fclose(upMeta);
+        free(path);
         return EMPTY_MESSAGE(ERROR_OPENING_FILE);
     }
 
@@ -421,7 +867,7 @@ Message finalizeUpload(const uint8_t *buf, size_t buflen)
 
     fileData = readFile(upReceived, &fileLen);
     if (fileData == NULL) {
-        fclose(upMeta);
+        free(path);
         fclose(upReceived);
         return EMPTY_MESSAGE(ERROR_READING_FILE);
     }
@@ -433,30 +879,29 @@ Message finalizeUpload(const uint8_t *buf, size_t buflen)
 
     free(fileData);
 
-    // read in the given shasum
-    uint8_t shaSumGiven[32];
-    if (fread(shaSumGiven, 32, 1, upMeta) != 1) {
-        fclose(upMeta);
-        return EMPTY_MESSAGE(ERROR_READING_FILE);
-    }
-    fclose(upMeta);
-
     // verify the calculated sum matches the given sum
-    if (!sha256cmp(shaSum, shaSumGiven))
+    if (!sha256cmp(shaSum, shaSumGiven)) {
+        free(path);
         return EMPTY_MESSAGE(ERROR_SHASUM_MISMATCH);
+    }
 
-    // Rename the upload temp file
+    // Move the upload temp file into place, copying it if the path is on another filesystem
     // TODO: log errors if any occur
-    char *path = malloc(buflen + 1);
-    memcpy(path, buf, buflen);
-    path[buflen] = '\0';
-
-    if (rename(UPLOAD_RECEIVED, path) == -1) {
-        perror("rename");
+    if (moveFile(UPLOAD_RECEIVED, path) == -1) {
+        perror("moveFile");
         free(path);
         return EMPTY_MESSAGE(ERROR_RENAMING_FILE);
     }
 
+    // Keep the content for later uploads of the same file, linked from where it ended up
+    // A file on another filesystem isn't kept, a second copy would take as much space as the file
+    if (contentStoreAdd(path, shaSum) == -1 && errno != EXDEV)
+        perror("contentStoreAdd");
+
+    // The sum was just verified, so a later download of this file needn't rehash it
+    if (stat(path, &st) == 0)
+        shaCacheStore(&st, shaSum);
+
     free(path);
 
     // Remove upload file metadata
@@ -468,11 +913,52 @@ Message finalizeUpload(const uint8_t *buf, size_t buflen)
     return EMPTY_MESSAGE(SUCCESS);
 }
 
+// Set when uploaded data is synced to stable storage
+Message setSyncPolicy(const uint8_t *buf, size_t buflen)
+{
+    if (buflen != 5)
+        return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+
+    // sync policy payload format
+    //   1 byte for the policy
+    //   4 bytes for the packet count, byte count or milliseconds between syncs
+
+    uint8_t policy = buf[0];
+    uint32_t value;
+    memcpy(&value, buf + 1, 4);
+
+    if (policy > MAX_SYNC_POLICY)
+        return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+
+    writeBehindSetPolicy(policy, value);
+
+    return EMPTY_MESSAGE(SUCCESS);
+}
+
 // Take a photo at the given time
+// Capture and encoding happen on the camera threads, this only queues the request
 Message takePhoto(const uint8_t *buf, size_t buflen)
 {
-    // TODO: I cannot implement this yet
-    // TODO: make sure to include payload bounds checking
+    static bool cameraStarted = false;
+
+    if (buflen != 8)
+        return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+
+    // take photo payload format
+    //   8 bytes for the unix time to take the photo at, times in the past are taken immediately
+
+    uint64_t time;
+    memcpy(&time, buf, 8);
+
+    if (!cameraStarted) {
+        if (cameraStart(&CAMERA_BACKEND) == -1)
+            return EMPTY_MESSAGE(ERROR_CAMERA_FAILURE);
+        cameraStarted = true;
+    }
+
+    if (cameraSchedule(time) == -1)
+        return EMPTY_MESSAGE(ERROR_CAMERA_BUSY);
+
     return EMPTY_MESSAGE(SUCCESS);
 }
 
@@ -490,6 +976,7 @@ Message executeCommand(const uint8_t *buf, size_t buflen)
     cmd[buflen] = '\0';
 
     int ret = system(cmd);
+    free(cmd);
     if (ret == -1)
         // TODO: Other, more meaningful error data?
         return EMPTY_MESSAGE(ERROR_SH_FAILURE);
@@ -505,3 +992,429 @@ Message executeCommand(const uint8_t *buf, size_t buflen)
         return m;
     }
 }
+
+// Run several commands from a single frame and return all of their replies together, within room bytes
+static Message batchWithin(const uint8_t *buf, size_t buflen, size_t room)
+{
+    if (buflen < 1)
+        return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+
+    // batch payload format
+    //   1 byte for flags, bit 0 set to keep going after a failed command
+    //   repeated for each command:
+    //     1 byte for command code
+    //     2 bytes for payload length
+    //     n bytes for payload
+
+    bool keepGoing = buf[0] & BATCH_CONTINUE_ON_ERROR;
+
+    // Check the whole batch is well formed before running any of it
+    size_t offset = 1;
+    while (offset < buflen) {
+        uint16_t len;
+        if (buflen - offset < 3)
+            return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+        if (buf[offset] > MAX_COMMAND_VAL || buf[offset] == BATCH)
+            return EMPTY_MESSAGE(ERROR_INVALID_COMMAND);
+        memcpy(&len, buf + offset + 1, 2);
+        if (buflen - offset - 3 < len)
+            return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+        offset += 3 + len;
+    }
+
+    // batch reply format
+    //   repeated for each command run:
+    //     1 byte for reply code
+    //     2 bytes for payload length
+    //     n bytes for payload
+    // The reply code is that of the first failed command, or success
+    // Informational replies like ZERO_RANGE or ALREADY_HAVE don't count as failures
+
+    Message m;
+    m.code = SUCCESS;
+    m.payloadLen = 0;
+    m.payload = NULL;
+
+    offset = 1;
+    while (offset < buflen) {
+        uint8_t code = buf[offset];
+        uint16_t len;
+        memcpy(&len, buf + offset + 1, 2);
+        const uint8_t *payload = buf + offset + 3;
+        offset += 3 + len;
+
+        // Stop once there's no room left for even an empty reply
+        if ((size_t) m.payloadLen + 3 > room) {
+            if (m.code == SUCCESS)
+                m.code = ERROR_BATCH_TOO_LONG;
+            break;
+        }
+
+        // Packets are cut to the room left, since a packet whose reply is dropped moves the
+        // download on without the ground getting it
+        size_t left = room - m.payloadLen - 3;
+        Message reply = runCommandWithin(code, payload, len, left);
+
+        // Other replies that don't fit are dropped, the commands with large replies can be
+        // repeated for the same data (LIST_DIRECTORY by cursor, FETCH_RESULTS until acknowledged)
+        if (reply.payloadLen > left) {
+            free(reply.payload);
+            if (m.code == SUCCESS)
+                m.code = ERROR_BATCH_TOO_LONG;
+            break;
+        }
+
+        m.payload = realloc(m.payload, m.payloadLen + 3 + reply.payloadLen);
+        m.payload[m.payloadLen] = reply.code;
+        memcpy(m.payload + m.payloadLen + 1, &reply.payloadLen, 2);
+        if (reply.payload != NULL)
+            memcpy(m.payload + m.payloadLen + 3, reply.payload, reply.payloadLen);
+        m.payloadLen += 3 + reply.payloadLen;
+
+        free(reply.payload);
+
+        if (replyIsError(reply.code)) {
+            if (m.code == SUCCESS)
+                m.code = reply.code;
+            if (!keepGoing)
+                break;
+        }
+    }
+
+    return m;
+}
+
+Message batch(const uint8_t *buf, size_t buflen)
+{
+    return batchWithin(buf, buflen, UINT16_MAX);
+}
+
+Message runCommandWithin(uint8_t code, const uint8_t *buf, size_t buflen, size_t room)
+{
+    if (code == REQUEST_PACKET || code == REQUEST_STRIPE)
+        return servePacket(buf, buflen, code == REQUEST_STRIPE, room);
+    if (code == BATCH)
+        return batchWithin(buf, buflen, room);
+    return commands[code](buf, buflen);
+}
+
+// Queue a command to be run at the given time
+Message scheduleCommand(const uint8_t *buf, size_t buflen)
+{
+    if (buflen < 9)
+        return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+
+    // schedule command payload format
+    //   8 bytes for the unix time to run the command at
+    //   1 byte for command code
+    //   n bytes for the command's payload
+
+    uint64_t time;
+    memcpy(&time, buf, 8);
+    uint8_t code = buf[8];
+
+    if (code > MAX_COMMAND_VAL)
+        return EMPTY_MESSAGE(ERROR_INVALID_COMMAND);
+
+    uint32_t id;
+    if (schedulerAdd(time, code, buf + 9, buflen - 9, &id) == -1) {
+        perror("schedulerAdd");
+        return EMPTY_MESSAGE(ERROR_WRITING_FILE);
+    }
+
+    // schedule success reply format
+    //   4 bytes for the id the result will be stored under
+
+    Message m;
+    m.code = SUCCESS;
+    m.payloadLen = 4;
+    m.payload = malloc(4);
+
+    memcpy(m.payload, &id, 4);
+
+    return m;
+}
+
+// Return the stored replies of scheduled commands that have run, forgetting those the ground acknowledges
+Message fetchResults(const uint8_t *buf, size_t buflen)
+{
+    if (buflen != 0 && buflen != 4)
+        return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+
+    // fetch results payload format
+    //   nothing to only fetch, or
+    //   4 bytes for the id of the last result received, it and every result before it are removed
+
+    uint32_t ackId = 0;
+    if (buflen == 4)
+        memcpy(&ackId, buf, 4);
+
+    // fetch results reply format
+    //   repeated for as many results as fit, oldest first:
+    //     4 bytes for the scheduled command's id
+    //     1 byte for reply code
+    //     2 bytes for payload length
+    //     n bytes for payload
+
+    Message m;
+    if (schedulerFetchResults(buflen == 4, ackId, &m) == -1) {
+        perror("schedulerFetchResults");
+        return EMPTY_MESSAGE(ERROR_READING_FILE);
+    }
+
+    return m;
+}
+
+// Queue a file to be downloaded automatically by requestPacket
+Message queueDownload(const uint8_t *buf, size_t buflen)
+{
+    if (buflen <= 9 || buflen - 9 >= DOWNLINK_PATH_LEN)
+        return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+
+    // queue download payload format
+    //   1 byte for priority, higher goes first
+    //   8 bytes for the unix time after which to drop the file, zero for never
+    //   n bytes for path
+
+    uint8_t priority = buf[0];
+    uint64_t deadline;
+    memcpy(&deadline, buf + 1, 8);
+
+    char path[DOWNLINK_PATH_LEN];
+    memcpy(path, buf + 9, buflen - 9);
+    path[buflen - 9] = '\0';
+
+    if (access(path, F_OK) != 0)
+        return EMPTY_MESSAGE(ERROR_FILE_DOESNT_EXIST);
+
+    if (downlinkPush(path, priority, deadline, 0) == -1)
+        return EMPTY_MESSAGE(ERROR_QUEUE_FULL);
+
+    return EMPTY_MESSAGE(SUCCESS);
+}
+
+// Limit how much packet data requestPacket sends until the budget is set again
+Message setPassBudget(const uint8_t *buf, size_t buflen)
+{
+    if (buflen != 8)
+        return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+
+    // pass budget payload format
+    //   8 bytes for the number of bytes, all ones for unlimited
+
+    memcpy(&passBudget, buf, 8);
+
+    return EMPTY_MESSAGE(SUCCESS);
+}
+
+// Describe the entries of a directory, a page at a time
+Message listDirectory(const uint8_t *buf, size_t buflen)
+{
+    if (buflen <= 9)
+        return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+
+    // list payload format
+    //   8 bytes for cursor, zero to start from the beginning, otherwise from the last reply
+    //   1 byte for flags, LIST_WITH_SHASUMS to include cached sha256sums
+    //   n bytes for directory path
+
+    uint64_t cursor;
+    memcpy(&cursor, buf, 8);
+    bool withSums = buf[8] & LIST_WITH_SHASUMS;
+
+    char *path = malloc(buflen - 9 + 1);
+    memcpy(path, buf + 9, buflen - 9);
+    path[buflen - 9] = '\0';
+
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY);
+    free(path);
+    if (dirfd < 0)
+        return EMPTY_MESSAGE(errno == ENOENT ? ERROR_FILE_DOESNT_EXIST : ERROR_OPENING_FILE);
+
+    if (cursor != 0 && lseek(dirfd, cursor, SEEK_SET) == -1) {
+        close(dirfd);
+        return EMPTY_MESSAGE(ERROR_SEEKING_FILE);
+    }
+
+    // list reply format
+    //   1 byte set once the end of the directory is reached
+    //   8 bytes for the cursor to continue from
+    //   repeated for each entry:
+    //     1 byte for type (DT_* value), with the top bit set if a sha256sum follows
+    //     8 bytes for size
+    //     8 bytes for modification time in unix nanoseconds
+    //     1 byte for name length
+    //     n bytes for name
+    //     32 bytes for sha256sum, if the top bit of type is set
+
+    Message m;
+    m.code = SUCCESS;
+    m.payloadLen = 9;
+    m.payload = malloc(UINT16_MAX);
+    m.payload[0] = 0;
+
+    uint8_t dents[8192];
+    bool full = false;
+    while (!full) {
+        long n = syscall(SYS_getdents64, dirfd, dents, sizeof(dents));
+        if (n < 0) {
+            close(dirfd);
+            free(m.payload);
+            return EMPTY_MESSAGE(ERROR_READING_FILE);
+        }
+        if (n == 0) {
+            m.payload[0] = 1;
+            break;
+        }
+
+        for (long pos = 0; pos < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *) (dents + pos);
+            pos += d->d_reclen;
+
+            size_t namelen = strlen(d->d_name);
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+                cursor = d->d_off;
+                continue;
+            }
+
+            // Leave the rest for the next page, resuming right after the last entry sent
+            if (m.payloadLen + 18 + namelen + 32 > UINT16_MAX) {
+                full = true;
+                break;
+            }
+
+            uint8_t type = d->d_type;
+            uint64_t size = 0;
+            int64_t mtime = 0;
+
+            struct stat st;
+            bool statted = fstatat(dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+            if (statted) {
+                size = st.st_size;
+                mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+            }
+
+            uint8_t shaSum[32];
+            bool hasSum = withSums && statted && S_ISREG(st.st_mode) && shaCacheLookup(&st, shaSum);
+            if (hasSum)
+                type |= 0x80;
+
+            uint8_t *entry = m.payload + m.payloadLen;
+            entry[0] = type;
+            memcpy(entry + 1, &size, 8);
+            memcpy(entry + 9, &mtime, 8);
+            entry[17] = namelen;
+            memcpy(entry + 18, d->d_name, namelen);
+            m.payloadLen += 18 + namelen;
+
+            if (hasSum) {
+                memcpy(m.payload + m.payloadLen, shaSum, 32);
+                m.payloadLen += 32;
+            }
+
+            cursor = d->d_off;
+        }
+    }
+
+    close(dirfd);
+
+    memcpy(m.payload + 1, &cursor, 8);
+    return m;
+}
+
+// Set the packet sizes the ground can handle and report the link statistics of the current session
+Message negotiatePacketSize(const uint8_t *buf, size_t buflen)
+{
+    if (buflen != 4)
+        return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+
+    // negotiate packet size payload format
+    //   2 bytes for the smallest packet size, zero for the payload's minimum
+    //   2 bytes for the largest packet size, all ones for the payload's maximum
+
+    uint16_t min, max;
+    memcpy(&min, buf, 2);
+    memcpy(&max, buf + 2, 2);
+
+    packetSizeNegotiate(min, max);
+
+    // negotiate packet size reply format
+    //   2 bytes for the current packet size
+    //   4 bytes for packets sent this session
+    //   4 bytes for packets resent this session
+    //   8 bytes for bytes sent this session
+    //   4 bytes for the smoothed time between packet requests in microseconds
+
+    LinkStats stats;
+    packetSizeStats(&stats);
+    uint16_t current = packetSizeCurrent();
+
+    Message m;
+    m.code = SUCCESS;
+    m.payloadLen = 22;
+    m.payload = malloc(22);
+
+    memcpy(m.payload, &current, 2);
+    memcpy(m.payload + 2, &stats.packets, 4);
+    memcpy(m.payload + 6, &stats.retries, 4);
+    memcpy(m.payload + 10, &stats.bytes, 8);
+    memcpy(m.payload + 18, &stats.interval, 4);
+
+    return m;
+}
+
+// Report the health of every serial link
+Message linkStatus(const uint8_t *buf, size_t buflen)
+{
+    if (buflen != 0)
+        return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+
+    // link status reply format
+    //   1 byte for the number of links
+    //   for each link, in the order the devices were given:
+    //     1 byte for whether the link is up
+    //     4 bytes for frames received
+    //     4 bytes for frames sent
+    //     8 bytes for bytes received
+    //     8 bytes for bytes sent
+    //     4 bytes for partial frames dropped
+    //     4 bytes for error replies sent
+
+    size_t count = linksCount();
+
+    Message m;
+    m.code = SUCCESS;
+    m.payloadLen = 1 + count * 33;
+    m.payload = malloc(m.payloadLen);
+    m.payload[0] = count;
+
+    uint8_t *entry = m.payload + 1;
+    for (size_t i = 0; i < count; ++i, entry += 33) {
+        LinkHealth health;
+        linkHealth(i, &health);
+
+        entry[0] = health.up;
+        memcpy(entry + 1, &health.framesIn, 4);
+        memcpy(entry + 5, &health.framesOut, 4);
+        memcpy(entry + 9, &health.bytesIn, 8);
+        memcpy(entry + 17, &health.bytesOut, 8);
+        memcpy(entry + 25, &health.framingErrors, 4);
+        memcpy(entry + 29, &health.errorReplies, 4);
+    }
+
+    return m;
+}
+
+// Choose which zeros of downloads are sent as zero ranges instead of data
+Message setSparseMode(const uint8_t *buf, size_t buflen)
+{
+    if (buflen != 1 || buf[0] > SPARSE_ZEROS)
+        return EMPTY_MESSAGE(ERROR_INVALID_PAYLOAD);
+
+    // sparse mode payload format
+    //   1 byte for the mode, SPARSE_OFF, SPARSE_HOLES or SPARSE_ZEROS for holes and zero runs in data
+
+    sparseMode = buf[0];
+
+    return EMPTY_MESSAGE(SUCCESS);
+}
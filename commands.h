@@ -1,25 +1,38 @@
 #ifndef commands_h_INCLUDED
 #define commands_h_INCLUDED
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
-// 32 kb
-#define PACKET_SIZE 0x8000
+#include "packet_size.h"
 
 #define MIN_COMMAND_VAL 0
-#define MAX_COMMAND_VAL 9
-
-#define POWEROFF        0
-#define START_DOWNLOAD  1
-#define START_UPLOAD    2
-#define REQUEST_PACKET  3
-#define SEND_PACKET     4
-#define CANCEL_UPLOAD   5
-#define CANCEL_DOWNLOAD 6
-#define FINALIZE_UPLOAD 7
-#define TAKE_PHOTO      8
-#define EXECUTE_COMMAND 9
+#define MAX_COMMAND_VAL 22
+
+#define POWEROFF              0
+#define START_DOWNLOAD        1
+#define START_UPLOAD          2
+#define REQUEST_PACKET        3
+#define SEND_PACKET           4
+#define CANCEL_UPLOAD         5
+#define CANCEL_DOWNLOAD       6
+#define FINALIZE_UPLOAD       7
+#define TAKE_PHOTO            8
+#define EXECUTE_COMMAND       9
+#define START_TREE_DOWNLOAD   10
+#define SET_SYNC_POLICY       11
+#define BATCH                 12
+#define SCHEDULE_COMMAND      13
+#define FETCH_RESULTS         14
+#define QUEUE_DOWNLOAD        15
+#define SET_PASS_BUDGET       16
+#define LIST_DIRECTORY        17
+#define NEGOTIATE_PACKET_SIZE 18
+#define REQUEST_STRIPE        19
+#define LINK_STATUS           20
+#define SET_SPARSE_MODE       21
+#define RESUME_UPLOAD         22
 
 #define SUCCESS                   0
 #define ERROR_OPENING_FILE        1
@@ -38,6 +51,22 @@
 #define ERROR_WRITING_FILE        14
 #define ERROR_REMOVING_FILE       15
 #define ERROR_RENAMING_FILE       16
+#define ERROR_CAMERA_FAILURE      17
+#define ERROR_CAMERA_BUSY         18
+#define ERROR_BATCH_TOO_LONG      19
+#define DOWNLOAD_STARTED          20
+#define ERROR_QUEUE_FULL          21
+#define ERROR_BUDGET_EXHAUSTED    22
+#define ALREADY_HAVE              23
+#define ERROR_AUTH_FAILED         24
+#define ERROR_STALE_SEQUENCE      25
+#define ZERO_RANGE                26
+
+// Replies that report what a command did rather than a failure
+static inline bool replyIsError(uint8_t code)
+{
+    return code != SUCCESS && code != DOWNLOAD_STARTED && code != ALREADY_HAVE && code != ZERO_RANGE;
+}
 
 typedef struct {
     uint8_t  code;
@@ -47,16 +76,39 @@ typedef struct {
 
 #define EMPTY_MESSAGE(c) (Message){c,0,NULL}
 
-Message poweroff(      const uint8_t *, size_t);
-Message startDownload( const uint8_t *, size_t);
-Message startUpload(   const uint8_t *, size_t);
-Message requestPacket( const uint8_t *, size_t);
-Message sendPacket(    const uint8_t *, size_t);
-Message cancelUpload(  const uint8_t *, size_t);
-Message cancelDownload(const uint8_t *, size_t);
-Message finalizeUpload(const uint8_t *, size_t);
-Message takePhoto(     const uint8_t *, size_t);
-Message executeCommand(const uint8_t *, size_t);
+// Batch flags
+#define BATCH_CONTINUE_ON_ERROR 0x01
+
+// List flags
+#define LIST_WITH_SHASUMS 0x01
+
+Message poweroff(           const uint8_t *, size_t);
+Message startDownload(      const uint8_t *, size_t);
+Message startUpload(        const uint8_t *, size_t);
+Message requestPacket(      const uint8_t *, size_t);
+Message sendPacket(         const uint8_t *, size_t);
+Message cancelUpload(       const uint8_t *, size_t);
+Message cancelDownload(     const uint8_t *, size_t);
+Message finalizeUpload(     const uint8_t *, size_t);
+Message takePhoto(          const uint8_t *, size_t);
+Message executeCommand(     const uint8_t *, size_t);
+Message startTreeDownload(  const uint8_t *, size_t);
+Message setSyncPolicy(      const uint8_t *, size_t);
+Message batch(              const uint8_t *, size_t);
+Message scheduleCommand(    const uint8_t *, size_t);
+Message fetchResults(       const uint8_t *, size_t);
+Message queueDownload(      const uint8_t *, size_t);
+Message setPassBudget(      const uint8_t *, size_t);
+Message listDirectory(      const uint8_t *, size_t);
+Message negotiatePacketSize(const uint8_t *, size_t);
+Message requestStripe(      const uint8_t *, size_t);
+Message linkStatus(         const uint8_t *, size_t);
+Message setSparseMode(      const uint8_t *, size_t);
+Message resumeUpload(       const uint8_t *, size_t);
+
+// Run a command for a reply that's carried inside another one, with room bytes for its payload
+// Packets and batches are cut to fit, other replies can still come back longer
+Message runCommandWithin(uint8_t code, const uint8_t *buf, size_t buflen, size_t room);
 
 static Message (*const commands[])(const uint8_t *, size_t) = {
     poweroff,
@@ -68,7 +120,20 @@ static Message (*const commands[])(const uint8_t *, size_t) = {
     cancelDownload,
     finalizeUpload,
     takePhoto,
-    executeCommand
+    executeCommand,
+    startTreeDownload,
+    setSyncPolicy,
+    batch,
+    scheduleCommand,
+    fetchResults,
+    queueDownload,
+    setPassBudget,
+    listDirectory,
+    negotiatePacketSize,
+    requestStripe,
+    linkStatus,
+    setSparseMode,
+    resumeUpload
 };
 
 static const char *const command_strs[] = {
@@ -81,7 +146,20 @@ static const char *const command_strs[] = {
     "cancel download",
     "finalize upload",
     "take photo",
-    "execute command"
+    "execute command",
+    "start tree download",
+    "set sync policy",
+    "batch",
+    "schedule command",
+    "fetch results",
+    "queue download",
+    "set pass budget",
+    "list directory",
+    "negotiate packet size",
+    "request stripe",
+    "link status",
+    "set sparse mode",
+    "resume upload"
 };
 
 static const char *const reply_strs[] = {
@@ -100,7 +178,18 @@ static const char *const reply_strs[] = {
     "error reading file",
     "error seeking file",
     "error writing to file",
-    "error removing file"
+    "error removing file",
+    "error renaming file",
+    "camera failure",
+    "camera busy",
+    "batch too long",
+    "download started",
+    "queue full",
+    "budget exhausted",
+    "already have",
+    "auth failed",
+    "stale sequence",
+    "zero range"
 };
 
 #endif // commands_h_INCLUDED
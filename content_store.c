@@ -0,0 +1,174 @@
+#include "content_store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_utils.h"
+#include "sha256_utils.h"
+#include "sha_cache.h"
+
+static void storePath(char path[sizeof(CONTENT_STORE) + 65], const uint8_t shaSum[32])
+{
+    char shaStr[65];
+    sha256str(shaStr, shaSum);
+    sprintf(path, CONTENT_STORE "/%s", shaStr);
+}
+
+bool contentStoreHas(const uint8_t shaSum[32])
+{
+    char path[sizeof(CONTENT_STORE) + 65];
+    storePath(path, shaSum);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return false;
+    }
+
+    // Stored files are hard links to uploaded files, which may have been changed in place since
+    // The sha cache makes checking them cheap while they haven't been
+    uint8_t actual[32];
+    if (!shaCacheLookup(&st, actual)) {
+        if (sha256fd(fd, actual) == -1) {
+            close(fd);
+            return false;
+        }
+        shaCacheStore(&st, actual);
+    }
+    close(fd);
+
+    if (!sha256cmp(actual, shaSum)) {
+        printf("Dropping modified store entry %s\n", path);
+        unlink(path);
+        return false;
+    }
+
+    return true;
+}
+
+typedef struct {
+    char name[65];
+    struct stat st;
+} StoreEntry;
+
+static int oldestFirst(const void *a, const void *b)
+{
+    const struct timespec *x = &((const StoreEntry *) a)->st.st_ctim;
+    const struct timespec *y = &((const StoreEntry *) b)->st.st_ctim;
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+// Evict entries until the store is back within its bounds
+// Linking and unlinking both update an inode's ctime, so it's when the content was last stored or placed
+static void trimStore(void)
+{
+    DIR *dir = opendir(CONTENT_STORE);
+    if (dir == NULL)
+        return;
+
+    size_t count = 0, capacity = 0;
+    StoreEntry *entries = NULL;
+    uint64_t orphanBytes = 0;
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strlen(de->d_name) != 64)
+            continue;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            StoreEntry *grown = realloc(entries, capacity * sizeof(StoreEntry));
+            if (grown == NULL)
+                break;
+            entries = grown;
+        }
+
+        StoreEntry *e = &entries[count];
+        strcpy(e->name, de->d_name);
+        if (fstatat(dirfd(dir), e->name, &e->st, 0) == -1)
+            continue;
+        if (e->st.st_nlink == 1)
+            orphanBytes += e->st.st_size;
+        ++count;
+    }
+
+    qsort(entries, count, sizeof(StoreEntry), oldestFirst);
+
+    size_t left = count;
+    for (size_t i = 0; i < count && (left > CONTENT_STORE_MAX_FILES || orphanBytes > CONTENT_STORE_MAX_BYTES); ++i) {
+        StoreEntry *e = &entries[i];
+        // Over the byte bound alone, dropping an entry that's still linked elsewhere frees nothing
+        if (left <= CONTENT_STORE_MAX_FILES && e->st.st_nlink != 1)
+            continue;
+
+        if (unlinkat(dirfd(dir), e->name, 0) == -1) {
+            perror("Error evicting store entry");
+            continue;
+        }
+        printf("Evicted store entry %s\n", e->name);
+        --left;
+        if (e->st.st_nlink == 1)
+            orphanBytes -= e->st.st_size;
+    }
+
+    free(entries);
+    closedir(dir);
+}
+
+int contentStoreAdd(const char *path, const uint8_t shaSum[32])
+{
+    if (mkdir(CONTENT_STORE, 0755) == -1 && errno != EEXIST)
+        return -1;
+
+    char stored[sizeof(CONTENT_STORE) + 65];
+    storePath(stored, shaSum);
+
+    // Replace whatever was stored before, it may be a stale copy
+    unlink(stored);
+    if (link(path, stored) == -1)
+        return -1;
+
+    trimStore();
+    return 0;
+}
+
+int contentStorePlace(const uint8_t shaSum[32], const char *path)
+{
+    char stored[sizeof(CONTENT_STORE) + 65];
+    storePath(stored, shaSum);
+
+    // link won't replace an existing file, so link beside path and rename over it like a normal finalize
+    char *tmp = malloc(strlen(path) + sizeof(".placing"));
+    sprintf(tmp, "%s.placing", path);
+    unlink(tmp);
+
+    int result;
+    if (link(stored, tmp) == 0) {
+        // rename does nothing if path is already this inode, so tmp is removed either way
+        result = rename(tmp, path);
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+    } else if (errno == EXDEV) {
+        // copyFile goes through a temp file and a rename of its own
+        result = copyFile(stored, path);
+    } else {
+        result = -1;
+    }
+
+    free(tmp);
+    return result;
+}
@@ -0,0 +1,28 @@
+#ifndef content_store_h_INCLUDED
+#define content_store_h_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Every verified upload is linked in here under its hex sha256sum,
+// so uploading the same content again can be skipped
+#define CONTENT_STORE "content-store"
+
+// The store is trimmed oldest first past either bound. The byte bound only counts entries
+// nothing else links to any more, since those are the ones taking space of their own
+#define CONTENT_STORE_MAX_FILES 256
+#define CONTENT_STORE_MAX_BYTES (256 << 20)
+
+// True if the store holds intact content with the given sum
+bool contentStoreHas(const uint8_t shaSum[32]);
+
+// Add a file known to have the given sum by hard linking it, returns -1 with errno set on failure
+// Files on another filesystem than the store fail with EXDEV and aren't stored
+int contentStoreAdd(const char *path, const uint8_t shaSum[32]);
+
+// Place the stored content at path, hard linking it or falling back to a copy across filesystems
+// Either is renamed over path, so a failure leaves whatever was there before
+// A hard linked file shares its inode with every other placement, so it should be replaced, not edited in place
+int contentStorePlace(const uint8_t shaSum[32], const char *path);
+
+#endif // content_store_h_INCLUDED
@@ -0,0 +1,153 @@
+#include "downlink_queue.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+/*
+ * The queue is short, so it's kept as a flat array and saved whole on every
+ * change. The lock is needed since the camera thread queues finished photos.
+ */
+static struct {
+    pthread_mutex_t lock;
+    bool loaded;
+    DownlinkEntry entries[DOWNLINK_QUEUE_LEN];
+    size_t count;
+    uint64_t nextSequence;
+} dq = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// Caller holds the lock
+static void load()
+{
+    if (dq.loaded)
+        return;
+    dq.loaded = true;
+
+    FILE *fp = fopen(DOWNLINK_QUEUE, "r");
+    if (fp == NULL)
+        return;
+
+    dq.count = fread(dq.entries, sizeof(DownlinkEntry), DOWNLINK_QUEUE_LEN, fp);
+    fclose(fp);
+
+    for (size_t i = 0; i < dq.count; ++i) {
+        if (dq.entries[i].sequence >= dq.nextSequence)
+            dq.nextSequence = dq.entries[i].sequence + 1;
+    }
+}
+
+// Caller holds the lock
+static int save()
+{
+    FILE *fp = fopen(DOWNLINK_QUEUE ".tmp", "w");
+    if (fp == NULL)
+        return -1;
+
+    bool written = fwrite(dq.entries, sizeof(DownlinkEntry), dq.count, fp) == dq.count;
+    if (fclose(fp) == EOF || !written || rename(DOWNLINK_QUEUE ".tmp", DOWNLINK_QUEUE) == -1) {
+        remove(DOWNLINK_QUEUE ".tmp");
+        return -1;
+    }
+
+    return 0;
+}
+
+static bool goesBefore(const DownlinkEntry *a, const DownlinkEntry *b)
+{
+    if (a->priority != b->priority)
+        return a->priority > b->priority;
+    if (a->deadline != b->deadline)
+        return b->deadline == 0 || (a->deadline != 0 && a->deadline < b->deadline);
+    return a->sequence < b->sequence;
+}
+
+// Drop expired entries and return the index of the next one, caller holds the lock
+static ssize_t best()
+{
+    uint64_t now = time(NULL);
+    bool dropped = false;
+
+    for (size_t i = 0; i < dq.count;) {
+        if (dq.entries[i].deadline != 0 && dq.entries[i].deadline < now) {
+            printf("Dropping expired download %s\n", dq.entries[i].path);
+            dq.entries[i] = dq.entries[--dq.count];
+            dropped = true;
+        } else {
+            ++i;
+        }
+    }
+
+    if (dropped && save() == -1)
+        perror("Error saving " DOWNLINK_QUEUE);
+
+    ssize_t next = -1;
+    for (size_t i = 0; i < dq.count; ++i) {
+        if (next == -1 || goesBefore(&dq.entries[i], &dq.entries[next]))
+            next = i;
+    }
+    return next;
+}
+
+int downlinkPush(const char *path, uint8_t priority, uint64_t deadline, uint64_t offset)
+{
+    if (strlen(path) >= DOWNLINK_PATH_LEN)
+        return -1;
+
+    pthread_mutex_lock(&dq.lock);
+    load();
+
+    if (dq.count == DOWNLINK_QUEUE_LEN) {
+        pthread_mutex_unlock(&dq.lock);
+        return -1;
+    }
+
+    DownlinkEntry *e = &dq.entries[dq.count++];
+    memset(e, 0, sizeof(DownlinkEntry));
+    e->priority = priority;
+    e->deadline = deadline;
+    e->offset = offset;
+    e->sequence = dq.nextSequence++;
+    strcpy(e->path, path);
+
+    int result = save();
+    if (result == -1)
+        --dq.count;
+
+    pthread_mutex_unlock(&dq.lock);
+    return result;
+}
+
+bool downlinkPeek(DownlinkEntry *entry)
+{
+    pthread_mutex_lock(&dq.lock);
+    load();
+
+    ssize_t next = best();
+    if (next != -1)
+        *entry = dq.entries[next];
+
+    pthread_mutex_unlock(&dq.lock);
+    return next != -1;
+}
+
+bool downlinkPop(DownlinkEntry *entry)
+{
+    pthread_mutex_lock(&dq.lock);
+    load();
+
+    ssize_t next = best();
+    if (next != -1) {
+        *entry = dq.entries[next];
+        dq.entries[next] = dq.entries[--dq.count];
+        if (save() == -1)
+            perror("Error saving " DOWNLINK_QUEUE);
+    }
+
+    pthread_mutex_unlock(&dq.lock);
+    return next != -1;
+}
@@ -0,0 +1,42 @@
+#ifndef downlink_queue_h_INCLUDED
+#define downlink_queue_h_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "packet_size.h"
+
+/*
+ * Files waiting to be downloaded, served by requestPacket whenever nothing
+ * else is being downloaded. Highest priority goes first, then earliest
+ * deadline, then first queued. Entries past their deadline are dropped.
+ */
+#define DOWNLINK_QUEUE     "downlink-queue"
+#define DOWNLINK_QUEUE_LEN 64
+#define DOWNLINK_PATH_LEN  256
+
+// A queued download with at least this much left is preempted by a higher priority one
+#define DOWNLINK_PREEMPT_BYTES (4 * PACKET_SIZE)
+
+// Priority photos are queued at
+#define PHOTO_PRIORITY 64
+
+typedef struct {
+    uint8_t  priority;
+    // Unix time after which the file isn't worth sending, zero for none
+    uint64_t deadline;
+    // Where to resume from if the download was preempted
+    uint64_t offset;
+    uint64_t sequence;
+    char     path[DOWNLINK_PATH_LEN];
+} DownlinkEntry;
+
+// Returns -1 if the queue is full or couldn't be saved
+int downlinkPush(const char *path, uint8_t priority, uint64_t deadline, uint64_t offset);
+
+// Copy out the entry that should go next, without removing it
+bool downlinkPeek(DownlinkEntry *entry);
+// Remove and return the entry that should go next
+bool downlinkPop(DownlinkEntry *entry);
+
+#endif // downlink_queue_h_INCLUDED
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include "file_utils.h"
+
+#include <errno.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Copy len bytes between fds without passing them through userspace
+static int copyInKernel(int in, int out, size_t len)
+{
+    // A reflink shares the extents outright, but only works within one filesystem
+    if (ioctl(out, FICLONE, in) == 0)
+        return 0;
+
+    size_t copied = 0;
+    bool useSendfile = false;
+    while (copied < len) {
+        ssize_t result;
+        if (!useSendfile) {
+            result = copy_file_range(in, NULL, out, NULL, len - copied, 0);
+            // Kernels before 5.3 can't copy_file_range across filesystems
+            if (result < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                useSendfile = true;
+                continue;
+            }
+        } else {
+            result = sendfile(out, in, NULL, len - copied);
+        }
+
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (result == 0) {
+            // The source shrank underneath us
+            errno = EIO;
+            return -1;
+        }
+        copied += result;
+    }
+
+    return 0;
+}
+
+static int syncParentDir(const char *path)
+{
+    char *copy = strdup(path);
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    free(copy);
+    if (fd < 0)
+        return -1;
+
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+int copyFile(const char *from, const char *to)
+{
+    int in = open(from, O_RDONLY);
+    if (in < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(in, &st) == -1) {
+        close(in);
+        return -1;
+    }
+
+    // Copy next to the destination so the final rename can't cross filesystems
+    char *tmp = malloc(strlen(to) + sizeof(".XXXXXX"));
+    sprintf(tmp, "%s.XXXXXX", to);
+
+    int out = mkstemp(tmp);
+    if (out < 0) {
+        free(tmp);
+        close(in);
+        return -1;
+    }
+
+    if (fchmod(out, st.st_mode & 07777) == -1
+        || copyInKernel(in, out, st.st_size) == -1
+        || fsync(out) == -1
+        || rename(tmp, to) == -1) {
+        int saved = errno;
+        close(in);
+        close(out);
+        unlink(tmp);
+        free(tmp);
+        errno = saved;
+        return -1;
+    }
+
+    close(in);
+    close(out);
+    free(tmp);
+
+    if (syncParentDir(to) == -1)
+        perror("Error syncing destination directory");
+
+    return 0;
+}
+
+int moveFile(const char *from, const char *to)
+{
+    if (rename(from, to) == 0)
+        return 0;
+    if (errno != EXDEV)
+        return -1;
+
+    if (copyFile(from, to) == -1)
+        return -1;
+
+    return unlink(from);
+}
@@ -0,0 +1,12 @@
+#ifndef file_utils_h_INCLUDED
+#define file_utils_h_INCLUDED
+
+// Copy a file in the kernel (reflink if the filesystem can), leaving the source in place
+// The destination is only ever replaced atomically with a complete, synced file
+// Returns 0 on success, -1 with errno set on failure
+int copyFile(const char *from, const char *to);
+
+// Move a file, falling back to copyFile when from and to are on different filesystems
+int moveFile(const char *from, const char *to);
+
+#endif // file_utils_h_INCLUDED
@@ -0,0 +1,149 @@
+#include "frame_auth.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hmac.h"
+
+#define DIRECTION_UPLINK   0
+#define DIRECTION_DOWNLINK 1
+
+// Longer keys are hashed down to 32 bytes anyway
+#define MAX_KEY_LEN 256
+
+static HmacKey key;
+static int seqfd = -1;
+// Highest sequence number accepted, and the first one not yet reserved on disk
+static uint64_t lastSeq;
+static uint64_t reserved;
+// Bit i is set once lastSeq - i has been accepted
+static uint64_t seen;
+
+static void frameMac(const Message *m, uint8_t direction, uint32_t seq, uint8_t mac[32])
+{
+    uint8_t header[8];
+    header[0] = direction;
+    memcpy(header + 1, &seq, 4);
+    header[5] = m->code;
+    memcpy(header + 6, &m->payloadLen, 2);
+
+    SHA256_CTX ctx;
+    hmacStart(&key, &ctx);
+    hmacUpdate(&ctx, header, sizeof(header));
+    if (m->payload != NULL)
+        hmacUpdate(&ctx, m->payload, m->payloadLen);
+    hmacFinish(&key, &ctx, mac);
+}
+
+static int loadKey(void)
+{
+    const char *path = getenv(FRAME_AUTH_KEY_ENV);
+    if (path == NULL || path[0] == '\0')
+        path = FRAME_AUTH_KEY;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening frame key %s\n", path);
+        return -1;
+    }
+
+    uint8_t secret[MAX_KEY_LEN];
+    size_t len = fread(secret, 1, sizeof(secret), fp);
+    fclose(fp);
+
+    // A short key is as good as no key
+    if (len < 16) {
+        fprintf(stderr, "Frame key %s is shorter than 16 bytes\n", path);
+        return -1;
+    }
+
+    hmacKeyInit(&key, secret, len);
+    memset(secret, 0, sizeof(secret));
+
+    return 0;
+}
+
+// The reservation has to be on disk before a command using it runs, or a
+// crash could let the same command be replayed
+static int reserve(uint64_t upTo)
+{
+    if (pwrite(seqfd, &upTo, 8, 0) != 8 || fsync(seqfd) == -1) {
+        perror("Error saving frame sequence");
+        return -1;
+    }
+
+    reserved = upTo;
+    return 0;
+}
+
+int frameAuthInit(void)
+{
+    if (loadKey() == -1)
+        return -1;
+
+    seqfd = open(FRAME_AUTH_SEQUENCE, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (seqfd < 0) {
+        perror("Error opening " FRAME_AUTH_SEQUENCE);
+        return -1;
+    }
+
+    // Anything up to the old reservation may have been used before the restart
+    uint64_t saved = 0;
+    if (pread(seqfd, &saved, 8, 0) != 8)
+        saved = 0;
+    lastSeq = saved;
+    reserved = saved;
+    seen = UINT64_MAX;
+
+    return 0;
+}
+
+bool frameAuthVerify(const Message *m, const uint8_t trailer[FRAME_AUTH_TRAILER], uint32_t *seq, Message *reject)
+{
+    memcpy(seq, trailer, 4);
+
+    uint8_t mac[32];
+    frameMac(m, DIRECTION_UPLINK, *seq, mac);
+    if (!hmacEqual(mac, trailer + 4)) {
+        *reject = EMPTY_MESSAGE(ERROR_AUTH_FAILED);
+        return false;
+    }
+
+    // stale sequence reply format
+    //   4 bytes for the lowest sequence number sure to be accepted
+    uint64_t behind = lastSeq - *seq;
+    if (*seq <= lastSeq && (behind >= FRAME_AUTH_WINDOW || seen & (uint64_t) 1 << behind)) {
+        uint32_t next = lastSeq + 1;
+        reject->code = ERROR_STALE_SEQUENCE;
+        reject->payloadLen = 4;
+        reject->payload = malloc(4);
+        memcpy(reject->payload, &next, 4);
+        return false;
+    }
+
+    // Numbers behind the highest were reserved when it was accepted
+    if (*seq <= lastSeq) {
+        seen |= (uint64_t) 1 << behind;
+        return true;
+    }
+
+    if (*seq >= reserved && reserve((uint64_t) *seq + FRAME_AUTH_RESERVE) == -1) {
+        *reject = EMPTY_MESSAGE(ERROR_WRITING_FILE);
+        return false;
+    }
+
+    uint64_t ahead = *seq - lastSeq;
+    seen = (ahead >= FRAME_AUTH_WINDOW ? 0 : seen << ahead) | 1;
+    lastSeq = *seq;
+    return true;
+}
+
+void frameAuthSign(const Message *m, uint32_t seq, uint8_t trailer[FRAME_AUTH_TRAILER])
+{
+    memcpy(trailer, &seq, 4);
+    frameMac(m, DIRECTION_DOWNLINK, seq, trailer + 4);
+}
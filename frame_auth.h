@@ -0,0 +1,43 @@
+#ifndef frame_auth_h_INCLUDED
+#define frame_auth_h_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "commands.h"
+
+/*
+ * Per-frame HMAC-SHA256 (built with -Dframe_auth=true). Every frame in either
+ * direction is followed by a trailer:
+ *   4 bytes for the sequence number
+ *   32 bytes for HMAC(key, direction || sequence || code || length || payload)
+ * Each sequence number is accepted once. Commands striped over several links
+ * arrive out of order, so anything within FRAME_AUTH_WINDOW of the highest
+ * accepted number that hasn't been seen yet is accepted too. Replies carry the
+ * sequence number of the command they answer and direction 1, so a reply can't
+ * be fed back as a command.
+ */
+#define FRAME_AUTH_KEY       "/etc/command-listener/frame-key"
+#define FRAME_AUTH_KEY_ENV   "FRAME_AUTH_KEY"
+#define FRAME_AUTH_SEQUENCE  "auth-sequence"
+#define FRAME_AUTH_TRAILER   36
+
+// How far behind the highest accepted sequence number a command may still arrive, one bit each
+#define FRAME_AUTH_WINDOW    64
+
+// Sequence numbers are reserved on disk this many at a time, so accepting a
+// command only touches the disk once per block. After a restart the rest of
+// the block is skipped and the ground learns where to continue from
+// ERROR_STALE_SEQUENCE.
+#define FRAME_AUTH_RESERVE   1024
+
+// Load the key and the sequence reservation, -1 if the key can't be read
+int frameAuthInit(void);
+
+// Check a command against its trailer, on failure reject is set to the reply to send
+bool frameAuthVerify(const Message *m, const uint8_t trailer[FRAME_AUTH_TRAILER], uint32_t *seq, Message *reject);
+
+// Build the trailer for a reply to the command with sequence number seq
+void frameAuthSign(const Message *m, uint32_t seq, uint8_t trailer[FRAME_AUTH_TRAILER]);
+
+#endif // frame_auth_h_INCLUDED
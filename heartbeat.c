@@ -0,0 +1,99 @@
+#include "heartbeat.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <linux/watchdog.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+static int gpiofd = -1;
+static int watchdogfd = -1;
+static int timerfd = -1;
+static bool level = false;
+
+static const char *pathFromEnv(const char *env, const char *fallback)
+{
+    const char *path = getenv(env);
+    return path != NULL && path[0] != '\0' ? path : fallback;
+}
+
+// Disarm the watchdog on a deliberate exit, a crash leaves it to reset the board
+static void disarmWatchdog(void)
+{
+    if (watchdogfd < 0)
+        return;
+
+    if (write(watchdogfd, "V", 1) != 1)
+        perror("Error disarming watchdog");
+    close(watchdogfd);
+    watchdogfd = -1;
+}
+
+int heartbeatInit(void)
+{
+    const char *gpioPath = pathFromEnv(HEARTBEAT_GPIO_ENV, HEARTBEAT_GPIO);
+    gpiofd = open(gpioPath, O_WRONLY | O_CLOEXEC);
+    if (gpiofd < 0)
+        fprintf(stderr, "Error opening heartbeat gpio %s, running without it\n", gpioPath);
+
+    // Opening a watchdog arms it with whatever timeout the driver defaults to, so it's set right away
+    const char *watchdogPath = getenv(WATCHDOG_DEVICE_ENV);
+    if (watchdogPath != NULL && watchdogPath[0] != '\0') {
+        watchdogfd = open(watchdogPath, O_WRONLY | O_CLOEXEC);
+        if (watchdogfd < 0) {
+            fprintf(stderr, "Error opening watchdog %s, running without it\n", watchdogPath);
+        } else {
+            atexit(disarmWatchdog);
+            int timeout = WATCHDOG_TIMEOUT_S;
+            if (ioctl(watchdogfd, WDIOC_SETTIMEOUT, &timeout) == -1) {
+                // A default that may be shorter than a long command would reset the board under it
+                perror("Error setting watchdog timeout, running without it");
+                disarmWatchdog();
+            } else if (timeout < WATCHDOG_TIMEOUT_S) {
+                fprintf(stderr, "Watchdog %s only allows a %d s timeout, running without it\n",
+                        watchdogPath, timeout);
+                disarmWatchdog();
+            }
+        }
+    }
+
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd < 0) {
+        perror("Error creating heartbeat timer");
+        return -1;
+    }
+
+    struct itimerspec its;
+    its.it_interval.tv_sec = HEARTBEAT_PERIOD_MS / 1000;
+    its.it_interval.tv_nsec = HEARTBEAT_PERIOD_MS % 1000 * 1000000;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(timerfd, 0, &its, NULL) == -1) {
+        perror("Error arming heartbeat timer");
+        close(timerfd);
+        timerfd = -1;
+        return -1;
+    }
+
+    return timerfd;
+}
+
+void heartbeatTick(void)
+{
+    uint64_t expirations;
+    if (read(timerfd, &expirations, 8) < 0)
+        return;
+
+    // Ticks missed while the loop was busy are dropped, a single toggle is proof enough it's back
+    level = !level;
+    if (gpiofd >= 0 && pwrite(gpiofd, level ? "1" : "0", 1, 0) != 1)
+        perror("Error writing heartbeat gpio");
+
+    if (watchdogfd >= 0 && write(watchdogfd, "k", 1) != 1)
+        perror("Error feeding watchdog");
+}
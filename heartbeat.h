@@ -0,0 +1,30 @@
+#ifndef heartbeat_h_INCLUDED
+#define heartbeat_h_INCLUDED
+
+/*
+ * Heartbeat GPIO toggle and hardware watchdog feed, driven from the listener's
+ * main loop. Since the timer is only serviced by that loop, a listener stuck
+ * anywhere else stops both and CDH (and the watchdog) can tell.
+ */
+#define HEARTBEAT_GPIO      "/sys/class/gpio/gpio398/value"
+#define HEARTBEAT_PERIOD_MS 1000
+
+// Environment variable overriding the path above, e.g. to point at a fake sysfs
+#define HEARTBEAT_GPIO_ENV  "HEARTBEAT_GPIO"
+
+/*
+ * The watchdog is opt-in, it's only opened when this names the device. Commands
+ * still block the loop (shell commands, hashing a whole file, copying across
+ * filesystems), so the timeout has to outlast the longest of them or the board
+ * resets mid-command.
+ */
+#define WATCHDOG_DEVICE_ENV "WATCHDOG_DEVICE"
+#define WATCHDOG_TIMEOUT_S  120
+
+// Returns the timerfd to poll for ticks, or -1 on failure
+int heartbeatInit(void);
+
+// Toggle the heartbeat and feed the watchdog, called when the timerfd is readable
+void heartbeatTick(void);
+
+#endif // heartbeat_h_INCLUDED
@@ -0,0 +1,194 @@
+#include "hmac.h"
+
+#include <string.h>
+
+#define HMAC_BLOCK_SIZE 64
+
+void hmacKeyInit(HmacKey *key, const uint8_t *secret, size_t len)
+{
+    uint8_t block[HMAC_BLOCK_SIZE] = {0};
+
+    // Keys longer than a block are hashed down first
+    if (len > HMAC_BLOCK_SIZE) {
+        SHA256_CTX ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, secret, len);
+        sha256_final(&ctx, block);
+    } else {
+        memcpy(block, secret, len);
+    }
+
+    uint8_t pad[HMAC_BLOCK_SIZE];
+
+    for (size_t i = 0; i < HMAC_BLOCK_SIZE; ++i)
+        pad[i] = block[i] ^ 0x36;
+    sha256_init(&key->inner);
+    sha256_update(&key->inner, pad, HMAC_BLOCK_SIZE);
+
+    for (size_t i = 0; i < HMAC_BLOCK_SIZE; ++i)
+        pad[i] = block[i] ^ 0x5c;
+    sha256_init(&key->outer);
+    sha256_update(&key->outer, pad, HMAC_BLOCK_SIZE);
+
+    memset(block, 0, sizeof(block));
+    memset(pad, 0, sizeof(pad));
+}
+
+void hmacStart(const HmacKey *key, SHA256_CTX *ctx)
+{
+    *ctx = key->inner;
+}
+
+void hmacUpdate(SHA256_CTX *ctx, const void *data, size_t len)
+{
+    sha256_update(ctx, data, len);
+}
+
+void hmacFinish(const HmacKey *key, SHA256_CTX *ctx, uint8_t mac[32])
+{
+    uint8_t innerSum[32];
+    sha256_final(ctx, innerSum);
+
+    SHA256_CTX outer = key->outer;
+    sha256_update(&outer, innerSum, 32);
+    sha256_final(&outer, mac);
+}
+
+bool hmacEqual(const uint8_t a[32], const uint8_t b[32])
+{
+    uint8_t diff = 0;
+    for (size_t i = 0; i < 32; ++i)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+#ifdef HMAC_TEST
+
+#include <stdio.h>
+
+// RFC 4231 test cases 1 and 6, the second covers keys longer than a block
+int main()
+{
+    static const struct {
+        uint8_t key[131];
+        size_t keylen;
+        const char *data;
+        uint8_t mac[32];
+    } cases[] = {
+        {
+            { [0 ... 19] = 0x0b }, 20,
+            "Hi There",
+            { 0xb0, 0x34, 0x4c, 0x61, 0xd8, 0xdb, 0x38, 0x53, 0x5c, 0xa8, 0xaf, 0xce, 0xaf, 0x0b, 0xf1, 0x2b,
+              0x88, 0x1d, 0xc2, 0x00, 0xc9, 0x83, 0x3d, 0xa7, 0x26, 0xe9, 0x37, 0x6c, 0x2e, 0x32, 0xcf, 0xf7 }
+        },
+        {
+            { [0 ... 130] = 0xaa }, 131,
+            "Test Using Larger Than Block-Size Key - Hash Key First",
+            { 0x60, 0xe4, 0x31, 0x59, 0x1e, 0xe0, 0xb6, 0x7f, 0x0d, 0x8a, 0x26, 0xaa, 0xcb, 0xf5, 0xb7, 0x7f,
+              0x8e, 0x0b, 0xc6, 0x21, 0x37, 0x28, 0xc5, 0x14, 0x05, 0x46, 0x04, 0x0f, 0x0e, 0xe3, 0x7f, 0x54 }
+        }
+    };
+
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        HmacKey key;
+        hmacKeyInit(&key, cases[i].key, cases[i].keylen);
+
+        SHA256_CTX ctx;
+        uint8_t mac[32];
+        hmacStart(&key, &ctx);
+        hmacUpdate(&ctx, cases[i].data, strlen(cases[i].data));
+        hmacFinish(&key, &ctx, mac);
+
+        bool ok = hmacEqual(mac, cases[i].mac);
+        printf("case %zu: %s\n", i + 1, ok ? "ok" : "FAILED");
+        failures += !ok;
+    }
+
+    return failures != 0;
+}
+
+#endif // HMAC_TEST
+
+#ifdef HMAC_BENCH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "packet_size.h"
+
+// B4000000 is the fastest rate termios has, 10 bits per byte with 8N1 framing
+#define MAX_BAUD 4000000
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// What every frame would cost if the padded key were hashed each time
+static void hmacUncached(const uint8_t *secret, size_t len, const uint8_t *data, size_t datalen, uint8_t mac[32])
+{
+    HmacKey key;
+    hmacKeyInit(&key, secret, len);
+    SHA256_CTX ctx;
+    hmacStart(&key, &ctx);
+    hmacUpdate(&ctx, data, datalen);
+    hmacFinish(&key, &ctx, mac);
+}
+
+int main()
+{
+    static const size_t sizes[] = { 0, 64, MIN_PACKET_SIZE, 4096, PACKET_SIZE, MAX_PACKET_SIZE };
+    const double lineRate = MAX_BAUD / 10.0;
+
+    uint8_t secret[32];
+    for (size_t i = 0; i < sizeof(secret); ++i)
+        secret[i] = i * 37;
+
+    uint8_t *frame = malloc(3 + MAX_PACKET_SIZE);
+    for (size_t i = 0; i < 3 + MAX_PACKET_SIZE; ++i)
+        frame[i] = i * 2654435761u >> 24;
+
+    HmacKey key;
+    hmacKeyInit(&key, secret, sizeof(secret));
+
+    printf("line rate at %d baud: %.0f B/s\n", MAX_BAUD, lineRate);
+    printf("%8s %12s %12s %12s %10s\n", "payload", "frames/s", "MAC B/s", "uncached/s", "headroom");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        size_t framelen = 3 + sizes[s];
+        // Seq, MAC and header on the wire along with the payload
+        size_t wirelen = framelen + 4 + 32;
+        long iters = (64 << 20) / (framelen + 64) + 1000;
+
+        uint8_t mac[32];
+        uint32_t seq = 0;
+        double start = now();
+        for (long i = 0; i < iters; ++i) {
+            SHA256_CTX ctx;
+            hmacStart(&key, &ctx);
+            hmacUpdate(&ctx, &seq, 4);
+            hmacUpdate(&ctx, frame, framelen);
+            hmacFinish(&key, &ctx, mac);
+            seq += mac[0];
+        }
+        double cached = (now() - start) / iters;
+
+        start = now();
+        for (long i = 0; i < iters; ++i)
+            hmacUncached(secret, sizeof(secret), frame, framelen, mac);
+        double uncached = (now() - start) / iters;
+
+        // How many times faster than the line can deliver these frames
+        double headroom = lineRate / wirelen * cached;
+        printf("%8zu %12.0f %12.0f %12.0f %9.1fx\n",
+               sizes[s], 1 / cached, wirelen / cached, 1 / uncached, 1 / headroom);
+    }
+
+    free(frame);
+}
+
+#endif // HMAC_BENCH
@@ -0,0 +1,30 @@
+#ifndef hmac_h_INCLUDED
+#define hmac_h_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+/*
+ * HMAC-SHA256 with the padded key hashed once up front. The inner and outer
+ * contexts are saved after absorbing key ^ ipad and key ^ opad, so each MAC
+ * only copies them and hashes the message and the inner digest.
+ */
+typedef struct {
+    SHA256_CTX inner;
+    SHA256_CTX outer;
+} HmacKey;
+
+void hmacKeyInit(HmacKey *key, const uint8_t *secret, size_t len);
+
+// Streaming MAC, ctx is started from the key's inner context
+void hmacStart(const HmacKey *key, SHA256_CTX *ctx);
+void hmacUpdate(SHA256_CTX *ctx, const void *data, size_t len);
+void hmacFinish(const HmacKey *key, SHA256_CTX *ctx, uint8_t mac[32]);
+
+// Compares in constant time so a forger can't learn the MAC a byte at a time
+bool hmacEqual(const uint8_t a[32], const uint8_t b[32]);
+
+#endif // hmac_h_INCLUDED
@@ -0,0 +1,594 @@
+#define _GNU_SOURCE
+#include "links.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#ifdef FRAME_AUTH
+#include "frame_auth.h"
+#define TRAILER_LEN FRAME_AUTH_TRAILER
+#else
+#define TRAILER_LEN 0
+#endif
+
+typedef struct {
+    const char *path;
+    int fd;
+
+    // Frame being assembled, received counts the header, payload and trailer bytes in order
+    uint8_t header[3];
+    uint8_t *payload;
+    uint16_t payloadLen;
+    uint8_t trailer[TRAILER_LEN + 1];
+    size_t received;
+    uint64_t lastByte;
+
+    // Reply being written out
+    uint8_t *out;
+    size_t outLen;
+    size_t outSent;
+
+    LinkHealth health;
+} Link;
+
+static Link links[MAX_LINKS];
+static size_t linkCount;
+
+static uint64_t nowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static void dropFrame(Link *l)
+{
+    free(l->payload);
+    l->payload = NULL;
+    l->received = 0;
+}
+
+// Errors on a uart are almost never recoverable, so the link is given up on
+// and the rest carry on. The listener exits once every link is down.
+static void linkDown(Link *l, const char *what)
+{
+    fprintf(stderr, "Error %s link %s: %s, taking it down\n", what, l->path, strerror(errno));
+    close(l->fd);
+    l->fd = -1;
+    l->health.up = false;
+    dropFrame(l);
+    free(l->out);
+    l->out = NULL;
+}
+
+size_t linksOpen(char *const paths[], size_t count)
+{
+    for (size_t i = 0; i < count && linkCount < MAX_LINKS; ++i) {
+        int fd = open(paths[i], O_RDWR | O_NOCTTY | O_SYNC | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "Error opening serial device %s: %s\n", paths[i], strerror(errno));
+            continue;
+        }
+
+        // Frames are binary, so no echo, line editing or newline translation
+        // The baud rate is left as it was set up before the listener started
+        struct termios tio;
+        if (isatty(fd) && tcgetattr(fd, &tio) == 0) {
+            cfmakeraw(&tio);
+            if (tcsetattr(fd, TCSANOW, &tio) == -1)
+                fprintf(stderr, "Error configuring serial device %s: %s\n", paths[i], strerror(errno));
+        }
+
+        Link *l = &links[linkCount++];
+        memset(l, 0, sizeof(*l));
+        l->path = paths[i];
+        l->fd = fd;
+        l->health.up = true;
+    }
+
+    return linkCount;
+}
+
+size_t linksCount(void)
+{
+    return linkCount;
+}
+
+size_t linksUp(void)
+{
+    size_t up = 0;
+    for (size_t i = 0; i < linkCount; ++i)
+        up += links[i].health.up;
+    return up;
+}
+
+void linksPollFds(struct pollfd *fds)
+{
+    for (size_t i = 0; i < linkCount; ++i) {
+        fds[i].fd = links[i].fd;
+        fds[i].events = links[i].out != NULL ? POLLOUT : POLLIN;
+        fds[i].revents = 0;
+    }
+}
+
+static void flush(Link *l)
+{
+    while (l->outSent < l->outLen) {
+        ssize_t result = write(l->fd, l->out + l->outSent, l->outLen - l->outSent);
+        if (result < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return;
+            linkDown(l, "writing to");
+            return;
+        }
+        l->outSent += result;
+        l->health.bytesOut += result;
+    }
+
+    free(l->out);
+    l->out = NULL;
+}
+
+// Returns true once the whole frame is in
+static bool receive(Link *l)
+{
+    while (true) {
+        uint8_t *dst;
+        size_t want;
+        if (l->received < 3) {
+            dst = l->header + l->received;
+            want = 3 - l->received;
+        } else if (l->received < 3 + l->payloadLen) {
+            dst = l->payload + (l->received - 3);
+            want = 3 + l->payloadLen - l->received;
+        } else if (l->received < 3 + l->payloadLen + TRAILER_LEN) {
+            dst = l->trailer + (l->received - 3 - l->payloadLen);
+            want = 3 + l->payloadLen + TRAILER_LEN - l->received;
+        } else {
+            return true;
+        }
+
+        ssize_t result = read(l->fd, dst, want);
+        if (result < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                linkDown(l, "reading from");
+            return false;
+        }
+        if (result == 0) {
+            errno = EPIPE;
+            linkDown(l, "reading from");
+            return false;
+        }
+
+        l->received += result;
+        l->health.bytesIn += result;
+        l->lastByte = nowMs();
+
+        if (l->received == 3) {
+            memcpy(&l->payloadLen, l->header + 1, 2);
+            l->payload = l->payloadLen > 0 ? malloc(l->payloadLen) : NULL;
+        }
+    }
+}
+
+bool linkService(size_t link, short revents, Message *m, uint8_t *trailer)
+{
+    Link *l = &links[link];
+    if (!l->health.up)
+        return false;
+
+    if (l->out != NULL) {
+        if (revents & (POLLOUT | POLLHUP | POLLERR))
+            flush(l);
+        // One command at a time per link, the next isn't read until the reply is out
+        return false;
+    }
+
+    if (!(revents & (POLLIN | POLLHUP | POLLERR)) || !receive(l))
+        return false;
+
+    m->code = l->header[0];
+    m->payloadLen = l->payloadLen;
+    m->payload = l->payload;
+    if (TRAILER_LEN > 0)
+        memcpy(trailer, l->trailer, TRAILER_LEN);
+
+    // The payload now belongs to the caller
+    l->payload = NULL;
+    l->received = 0;
+    ++l->health.framesIn;
+
+    return true;
+}
+
+void linkReply(size_t link, const Message *reply, const uint8_t *trailer, size_t trailerLen)
+{
+    Link *l = &links[link];
+    if (!l->health.up)
+        return;
+
+    l->outLen = 3 + reply->payloadLen + trailerLen;
+    l->outSent = 0;
+    l->out = malloc(l->outLen);
+
+    l->out[0] = reply->code;
+    memcpy(l->out + 1, &reply->payloadLen, 2);
+    if (reply->payload != NULL)
+        memcpy(l->out + 3, reply->payload, reply->payloadLen);
+    if (trailerLen > 0)
+        memcpy(l->out + 3 + reply->payloadLen, trailer, trailerLen);
+
+    ++l->health.framesOut;
+    if (replyIsError(reply->code))
+        ++l->health.errorReplies;
+
+    // Most replies fit in the uart's buffer and go out right away
+    flush(l);
+}
+
+void linksExpire(void)
+{
+    uint64_t now = nowMs();
+    for (size_t i = 0; i < linkCount; ++i) {
+        Link *l = &links[i];
+        if (!l->health.up || l->received == 0 || now - l->lastByte < LINK_FRAME_TIMEOUT_MS)
+            continue;
+
+        fprintf(stderr, "Dropping partial frame of %zu bytes on link %s\n", l->received, l->path);
+        dropFrame(l);
+        ++l->health.framingErrors;
+    }
+}
+
+void linkHealth(size_t link, LinkHealth *health)
+{
+    *health = links[link].health;
+}
+
+#ifdef LINKS_TEST
+
+/*
+ * Ground side of a striped download over pty pairs, standing in for CDH:
+ *   test-links <command-listener> <file> [links] [baud] [drop every nth packet]
+ * The listener runs in a temporary directory with the pty slaves as its
+ * devices. Reading from the masters is held to the given baud rate, so
+ * the ptys behave like uarts and the aggregate rate can be compared
+ * across link counts. Dropped packets are resent by offset at the end.
+ * For a listener built with frame_auth, point FRAME_AUTH_KEY at its key
+ * and every frame is signed and every reply checked.
+ */
+
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "frame_auth.h"
+#include "hmac.h"
+#include "sha256_utils.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Set up from FRAME_AUTH_KEY, the listener inherits the variable and uses the same key
+static bool auth;
+static HmacKey authKey;
+static uint32_t authSeq;
+
+static void frameMac(uint8_t direction, uint32_t seq, uint8_t code, const void *payload, uint16_t len, uint8_t mac[32])
+{
+    uint8_t header[8];
+    header[0] = direction;
+    memcpy(header + 1, &seq, 4);
+    header[5] = code;
+    memcpy(header + 6, &len, 2);
+
+    SHA256_CTX ctx;
+    hmacStart(&authKey, &ctx);
+    hmacUpdate(&ctx, header, sizeof(header));
+    hmacUpdate(&ctx, payload, len);
+    hmacFinish(&authKey, &ctx, mac);
+}
+
+static void loadAuthKey(void)
+{
+    const char *path = getenv(FRAME_AUTH_KEY_ENV);
+    if (path == NULL || path[0] == '\0')
+        return;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror("Error opening frame key");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t secret[256];
+    size_t len = fread(secret, 1, sizeof(secret), fp);
+    fclose(fp);
+
+    hmacKeyInit(&authKey, secret, len);
+    auth = true;
+}
+
+typedef struct {
+    int fd;
+    uint8_t frame[3 + 0xFFFF + FRAME_AUTH_TRAILER];
+    size_t received;
+    // Bytes the emulated line can still deliver, refilled at the baud rate
+    double credit;
+    uint32_t packets;
+    bool done;
+} Ground;
+
+static void sendFrame(int fd, uint8_t code, const void *payload, uint16_t len)
+{
+    uint8_t header[3];
+    header[0] = code;
+    memcpy(header + 1, &len, 2);
+
+    // Sequence numbers go up in the order frames are sent, the links may deliver them in any other
+    uint8_t trailer[FRAME_AUTH_TRAILER];
+    size_t trailerLen = auth ? FRAME_AUTH_TRAILER : 0;
+    if (auth) {
+        ++authSeq;
+        memcpy(trailer, &authSeq, 4);
+        frameMac(0, authSeq, code, payload, len, trailer + 4);
+    }
+
+    if (write(fd, header, 3) != 3 || (len > 0 && write(fd, payload, len) != len)
+        || (trailerLen > 0 && write(fd, trailer, trailerLen) != (ssize_t) trailerLen)) {
+        perror("Error writing to pty");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Read what the line allows, returns true once a whole reply is in
+static bool receiveFrame(Ground *g)
+{
+    size_t trailerLen = auth ? FRAME_AUTH_TRAILER : 0;
+    size_t want = g->received < 3 ? 3 - g->received : 0;
+    if (g->received >= 3) {
+        uint16_t len;
+        memcpy(&len, g->frame + 1, 2);
+        want = 3 + len + trailerLen - g->received;
+    }
+    if (want > g->credit)
+        want = g->credit;
+    if (want == 0)
+        return false;
+
+    ssize_t result = read(g->fd, g->frame + g->received, want);
+    if (result <= 0)
+        return false;
+    g->received += result;
+    g->credit -= result;
+
+    if (g->received < 3)
+        return false;
+    uint16_t len;
+    memcpy(&len, g->frame + 1, 2);
+    if (g->received != 3 + len + trailerLen)
+        return false;
+
+    if (auth) {
+        uint32_t seq;
+        uint8_t mac[32];
+        memcpy(&seq, g->frame + 3 + len, 4);
+        frameMac(1, seq, g->frame[0], g->frame + 3, len, mac);
+        if (!hmacEqual(mac, g->frame + 3 + len + 4)) {
+            fprintf(stderr, "Reply to command %u doesn't authenticate\n", seq);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return true;
+}
+
+// Send a command on one link and wait for its reply, for everything but the striping itself
+static uint8_t exchange(Ground *g, uint8_t code, const void *payload, uint16_t len)
+{
+    sendFrame(g->fd, code, payload, len);
+    g->credit = sizeof(g->frame);
+    g->received = 0;
+    struct pollfd pfd = { .fd = g->fd, .events = POLLIN };
+    while (!receiveFrame(g)) {
+        if (poll(&pfd, 1, 5000) <= 0) {
+            fprintf(stderr, "No reply to command %u\n", code);
+            exit(EXIT_FAILURE);
+        }
+    }
+    g->received = 0;
+    return g->frame[0];
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <command-listener> <file> [links] [baud] [drop every nth packet]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *file = realpath(argv[2], NULL);
+    size_t count = argc > 3 ? strtoul(argv[3], NULL, 0) : 2;
+    double rate = (argc > 4 ? strtod(argv[4], NULL) : 115200) / 10;
+    unsigned long dropEvery = argc > 5 ? strtoul(argv[5], NULL, 0) : 0;
+    if (file == NULL || count == 0 || count > MAX_LINKS) {
+        fprintf(stderr, "Need an existing file and 1 to %d links\n", MAX_LINKS);
+        return EXIT_FAILURE;
+    }
+
+    struct stat st;
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL || fstat(fileno(fp), &st) == -1) {
+        perror("Error opening file");
+        return EXIT_FAILURE;
+    }
+    long filelen = st.st_size;
+    uint8_t *expected = malloc(filelen);
+    if (fread(expected, 1, filelen, fp) != filelen) {
+        perror("Error reading file");
+        return EXIT_FAILURE;
+    }
+    fclose(fp);
+    loadAuthKey();
+
+    // The slaves are put in raw mode here too, so nothing is mangled before the listener gets to them
+    Ground ground[MAX_LINKS] = {0};
+    char *slaves[MAX_LINKS + 2];
+    slaves[0] = argv[1];
+    for (size_t i = 0; i < count; ++i) {
+        ground[i].fd = posix_openpt(O_RDWR | O_NOCTTY);
+        if (ground[i].fd < 0 || grantpt(ground[i].fd) == -1 || unlockpt(ground[i].fd) == -1) {
+            perror("Error opening pty");
+            return EXIT_FAILURE;
+        }
+        slaves[i + 1] = strdup(ptsname(ground[i].fd));
+
+        int slave = open(slaves[i + 1], O_RDWR | O_NOCTTY);
+        struct termios tio;
+        tcgetattr(slave, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(slave, TCSANOW, &tio);
+        tcgetattr(ground[i].fd, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(ground[i].fd, TCSANOW, &tio);
+    }
+    slaves[count + 1] = NULL;
+
+    char dir[] = "/tmp/test-links-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("Error making working directory");
+        return EXIT_FAILURE;
+    }
+
+    pid_t listener = fork();
+    if (listener == 0) {
+        // Keep the test away from real hardware
+        setenv("HEARTBEAT_GPIO", "/dev/null", 1);
+        unsetenv("WATCHDOG_DEVICE");
+        if (chdir(dir) == -1 || freopen("/dev/null", "w", stdout) == NULL)
+            _exit(EXIT_FAILURE);
+        execv(argv[1], slaves);
+        perror("Error running listener");
+        _exit(EXIT_FAILURE);
+    }
+
+    uint8_t code = exchange(&ground[0], START_DOWNLOAD, file, strlen(file));
+    if (code != SUCCESS) {
+        fprintf(stderr, "Download didn't start: %s\n", reply_strs[code]);
+        return EXIT_FAILURE;
+    }
+    uint8_t shaSum[32];
+    memcpy(shaSum, ground[0].frame + 3, 32);
+
+    uint8_t *data = calloc(filelen, 1);
+    bool *have = calloc(filelen, 1);
+    unsigned long served = 0;
+    size_t done = 0;
+
+    // Sent last link first while the listener reads them first link first, so with frame_auth
+    // the sequence numbers arrive out of order the way unevenly loaded uarts deliver them
+    double begin = now(), last = begin;
+    for (size_t i = count; i-- > 0;) {
+        ground[i].credit = 0;
+        sendFrame(ground[i].fd, REQUEST_STRIPE, NULL, 0);
+    }
+
+    while (done < count) {
+        struct pollfd fds[MAX_LINKS];
+        for (size_t i = 0; i < count; ++i) {
+            fds[i].fd = ground[i].done ? -1 : ground[i].fd;
+            fds[i].events = POLLIN;
+        }
+        poll(fds, count, 1);
+
+        // The emulated line rate
+        double t = now();
+        for (size_t i = 0; i < count; ++i) {
+            ground[i].credit += (t - last) * rate;
+            if (ground[i].credit > 4096)
+                ground[i].credit = 4096;
+        }
+        last = t;
+
+        for (size_t i = 0; i < count; ++i) {
+            Ground *g = &ground[i];
+            if (g->done || !(fds[i].revents & POLLIN) || !receiveFrame(g))
+                continue;
+            g->received = 0;
+
+            if (g->frame[0] == ERROR_DOWNLOAD_OVER) {
+                g->done = true;
+                ++done;
+                continue;
+            }
+            if (g->frame[0] != SUCCESS) {
+                fprintf(stderr, "Link %zu: %s\n", i, reply_strs[g->frame[0]]);
+                return EXIT_FAILURE;
+            }
+
+            uint16_t len;
+            uint64_t offset;
+            memcpy(&len, g->frame + 1, 2);
+            memcpy(&offset, g->frame + 3, 8);
+            ++g->packets;
+
+            if (dropEvery == 0 || ++served % dropEvery != 0) {
+                memcpy(data + offset, g->frame + 11, len - 8);
+                memset(have + offset, true, len - 8);
+            }
+
+            sendFrame(g->fd, REQUEST_STRIPE, NULL, 0);
+        }
+    }
+
+    // Fill in the dropped packets by offset, over the first link
+    unsigned long resent = 0;
+    for (uint64_t offset = 0; offset < filelen; ++offset) {
+        if (have[offset])
+            continue;
+        if (exchange(&ground[0], REQUEST_STRIPE, &offset, 8) != SUCCESS) {
+            fprintf(stderr, "Resend at %llu failed\n", (unsigned long long) offset);
+            return EXIT_FAILURE;
+        }
+        uint16_t len;
+        memcpy(&len, ground[0].frame + 1, 2);
+        memcpy(data + offset, ground[0].frame + 11, len - 8);
+        memset(have + offset, true, len - 8);
+        ++resent;
+    }
+    double elapsed = now() - begin;
+
+    uint8_t gotSum[32];
+    sha256calc(data, filelen, gotSum);
+    bool ok = memcmp(data, expected, filelen) == 0 && memcmp(gotSum, shaSum, 32) == 0;
+
+    exchange(&ground[0], CANCEL_DOWNLOAD, NULL, 0);
+    exchange(&ground[0], LINK_STATUS, NULL, 0);
+
+    printf("%ld bytes over %zu links at %.0f B/s each: %.2f s, %.0f B/s, %lu resent, %s\n",
+           filelen, count, rate, elapsed, filelen / elapsed, resent, ok ? "ok" : "MISMATCH");
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t *entry = ground[0].frame + 4 + i * 33;
+        uint32_t framesIn, errors;
+        memcpy(&framesIn, entry + 1, 4);
+        memcpy(&errors, entry + 29, 4);
+        printf("  link %zu: %s, %u packets, %u frames in, %u error replies\n",
+               i, entry[0] ? "up" : "down", ground[i].packets, framesIn, errors);
+    }
+
+    kill(listener, SIGTERM);
+    waitpid(listener, NULL, 0);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif // LINKS_TEST
@@ -0,0 +1,57 @@
+#ifndef links_h_INCLUDED
+#define links_h_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <poll.h>
+
+#include "commands.h"
+
+/*
+ * Bonded serial links. Every link carries its own request/reply exchange,
+ * so CDH can keep one command in flight per link and stripe a download
+ * across all of them with REQUEST_STRIPE. Frames are assembled as bytes
+ * arrive and replies are written as the link drains, so a slow link never
+ * holds up the others.
+ */
+#define MAX_LINKS 8
+
+// A frame that stops arriving partway is dropped after this long, so a link that lost bytes
+// gets back in step with CDH instead of reading the next command as the rest of the old one
+#define LINK_FRAME_TIMEOUT_MS 2000
+
+typedef struct {
+    uint32_t framesIn;
+    uint32_t framesOut;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    // Partial frames dropped after LINK_FRAME_TIMEOUT_MS
+    uint32_t framingErrors;
+    // Replies other than SUCCESS
+    uint32_t errorReplies;
+    bool up;
+} LinkHealth;
+
+// Open the serial devices in raw mode, returns how many opened
+size_t linksOpen(char *const paths[], size_t count);
+
+size_t linksCount(void);
+size_t linksUp(void);
+
+// Fill in a pollfd for every link, waiting to write on the ones with a reply pending
+void linksPollFds(struct pollfd *fds);
+
+// Handle a link's poll events, returns true with m and trailer filled in once a frame is complete
+bool linkService(size_t link, short revents, Message *m, uint8_t *trailer);
+
+// Queue a reply on the link, it's written out as the link drains
+void linkReply(size_t link, const Message *reply, const uint8_t *trailer, size_t trailerLen);
+
+// Drop partial frames that have timed out
+void linksExpire(void);
+
+void linkHealth(size_t link, LinkHealth *health);
+
+#endif // links_h_INCLUDED
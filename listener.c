@@ -1,118 +1,125 @@
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <fcntl.h>
-#include <unistd.h>
+#include <poll.h>
 
 #include "commands.h"
+#include "frame_auth.h"
+#include "heartbeat.h"
+#include "links.h"
+#include "scheduler.h"
 
 #define SERIAL_DEVICE "/dev/ttyUSB0"
 
 /*
- * Justification for *OrDie functions:
- * If read or write operations on the uart device fail
+ * Justification for exiting when every link is down:
+ * If read or write operations on a uart device fail
  * there's nothing we can do to recover from almost all
- * of the failures, so doing a complete system restart is
- * most likely the safest thing to do.
+ * of the failures. With other links still up the transfer
+ * carries on over those, once none are left doing a
+ * complete system restart is most likely the safest thing to do.
  */
 
-// TODO: CALL TERMIOS TO CONFIGURE TTY PROPERLY
-
-void readAllOrDie(int fd, void *buf, size_t len)
-{
-    size_t offset = 0;
-    ssize_t result;
-    while (offset < len) {
-        result = read(fd, buf + offset, len - offset);
-        if (result < 0) {
-            perror("Error reading from file descriptor");
-            exit(EXIT_FAILURE);
-        }
-        offset += result;
-    }
-}
-
-void writeAllOrDie(int fd, const void *buf, size_t len)
+Message evaluate(const Message m)
 {
-    size_t offset = 0;
-    ssize_t result;
-    while (offset < len) {
-        result = write(fd, buf + offset, len - offset);
-        if (result < 0) {
-            perror("Error writing to file descriptor");
-            exit(EXIT_FAILURE);
-        }
-        offset += result;
-    }
-}
-
-void writeMessage(int fd, const Message m)
-{
-    // Debug info
-    printf("Sending  reply:   %-19s with %8u bytes of data\n", reply_strs[m.code], m.payloadLen);
-
-    uint8_t outHeader[3];
-    outHeader[0] = m.code;
-    memcpy(outHeader + 1, &m.payloadLen, 2);
-
-    writeAllOrDie(fd, outHeader, sizeof(outHeader));
-    if (m.payload != NULL)
-        writeAllOrDie(fd, m.payload, m.payloadLen);
+    // Check that the received command is a valid one
+    // Evaluate the command
+    if (m.code < MIN_COMMAND_VAL || m.code > MAX_COMMAND_VAL)
+        return EMPTY_MESSAGE(ERROR_INVALID_COMMAND);
+    return commands[m.code](m.payload, m.payloadLen);
 }
 
-Message readMessage(int fd)
+// Usage: command-listener [serial device...], the devices are bonded into one set of links
+int main(int argc, char **argv)
 {
-    uint8_t inHeader[3];
-    readAllOrDie(fd, inHeader, sizeof(inHeader));
-
-    Message m;
-    m.code = inHeader[0];
-    memcpy(&m.payloadLen, inHeader + 1, 2);
-
-    m.payload = NULL;
-    if (m.payloadLen > 0) {
-        m.payload = malloc(m.payloadLen);
-        readAllOrDie(fd, m.payload, m.payloadLen);
+#ifdef FRAME_AUTH
+    // Without the key every command would be rejected, so there's no point running
+    if (frameAuthInit() == -1)
+        exit(EXIT_FAILURE);
+#endif
+
+    // Open the serial devices
+    static char *defaultDevices[] = { SERIAL_DEVICE };
+    size_t opened = argc > 1 ? linksOpen(argv + 1, argc - 1) : linksOpen(defaultDevices, 1);
+    if (opened == 0) {
+        // If no device opened, there's nothing we can do besides exit
+        fprintf(stderr, "No serial device could be opened\n");
+        exit(EXIT_FAILURE);
     }
 
-    // Debug info
-    printf("Received command: %-19s with %8u bytes of data\n", command_strs[m.code], m.payloadLen);
+    // Time-tagged commands run from the same loop, so they never race the serial ones
+    // The heartbeat is ticked from here too so it stops if the loop ever gets stuck
+    // Without either the listener still serves the serial lines, poll ignores the -1
+    int timerfd = schedulerInit();
+    int heartbeatfd = heartbeatInit();
 
-    return m;
-}
-
-int main()
-{
-    // Open the serial device
-    int serialfd = open(SERIAL_DEVICE, O_RDWR | O_NOCTTY | O_SYNC);
-    if (serialfd < 0) {
-        perror("Error opening serial device " SERIAL_DEVICE);
-        // If the file descriptor failed to open, there's nothing we can do besides exit
-        exit(EXIT_FAILURE);
-    }
+    // The links come first, then the timers
+    size_t nlinks = linksCount();
+    struct pollfd fds[MAX_LINKS + 2];
+    fds[nlinks].fd = timerfd;
+    fds[nlinks].events = POLLIN;
+    fds[nlinks + 1].fd = heartbeatfd;
+    fds[nlinks + 1].events = POLLIN;
 
     // Enter an infinite loop listening for and responding to messages
     while (true) {
-        // Read message from the serial line
-        Message m = readMessage(serialfd);
-
-        // Check that the received command is a valid one
-        // Evaluate the command
-        Message reply;
-        if (m.code < MIN_COMMAND_VAL || m.code > MAX_COMMAND_VAL)
-            reply = EMPTY_MESSAGE(ERROR_INVALID_COMMAND);
-        else
-            reply = commands[m.code](m.payload, m.payloadLen);
+        linksPollFds(fds);
+        if (poll(fds, nlinks + 2, LINK_FRAME_TIMEOUT_MS) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error polling");
+            exit(EXIT_FAILURE);
+        }
 
-        if (m.payload != NULL)
-            free(m.payload);
+        if (fds[nlinks + 1].revents & POLLIN)
+            heartbeatTick();
+
+        if (fds[nlinks].revents & POLLIN)
+            schedulerRun();
+
+        for (size_t i = 0; i < nlinks; ++i) {
+            Message m;
+            uint8_t trailer[FRAME_AUTH_TRAILER];
+            if (!linkService(i, fds[i].revents, &m, trailer))
+                continue;
+
+            // Debug info
+            printf("Received command: %-21s with %8u bytes of data on link %zu\n",
+                   m.code <= MAX_COMMAND_VAL ? command_strs[m.code] : "invalid", m.payloadLen, i);
+
+            Message reply;
+#ifdef FRAME_AUTH
+            // Only authentic commands are evaluated, otherwise reply holds the rejection
+            uint32_t seq;
+            if (frameAuthVerify(&m, trailer, &seq, &reply))
+                reply = evaluate(m);
+            frameAuthSign(&reply, seq, trailer);
+            size_t trailerLen = FRAME_AUTH_TRAILER;
+#else
+            reply = evaluate(m);
+            size_t trailerLen = 0;
+#endif
+
+            if (m.payload != NULL)
+                free(m.payload);
+
+            // Write out the reply message
+            printf("Sending  reply:   %-21s with %8u bytes of data on link %zu\n",
+                   reply_strs[reply.code], reply.payloadLen, i);
+            linkReply(i, &reply, trailer, trailerLen);
+
+            if (reply.payload != NULL)
+                free(reply.payload);
+        }
 
-        // Write out the reply message
-        writeMessage(serialfd, reply);
+        linksExpire();
 
-        if (reply.payload != NULL)
-            free(reply.payload);
+        if (linksUp() == 0) {
+            fprintf(stderr, "Every serial link is down\n");
+            exit(EXIT_FAILURE);
+        }
     }
 }
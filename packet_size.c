@@ -0,0 +1,158 @@
+#include "packet_size.h"
+
+#include <string.h>
+#include <time.h>
+
+static struct {
+    uint16_t min;
+    uint16_t max;
+    uint32_t size;
+
+    LinkStats stats;
+    uint64_t  lastPacket;
+} ps = {
+    .min = MIN_PACKET_SIZE,
+    // A ground that never negotiates may only handle the fixed size packets always had
+    .max = PACKET_SIZE,
+    .size = PACKET_SIZE
+};
+
+static uint64_t nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void clampSize()
+{
+    if (ps.size < ps.min)
+        ps.size = ps.min;
+    if (ps.size > ps.max)
+        ps.size = ps.max;
+}
+
+// Fold the time since the last packet into the smoothed interval
+static void recordInterval()
+{
+    uint64_t now = nowUs();
+    if (ps.lastPacket != 0) {
+        uint64_t interval = now - ps.lastPacket;
+        ps.stats.interval = ps.stats.interval == 0 ? interval : (ps.stats.interval * 7 + interval) / 8;
+    }
+    ps.lastPacket = now;
+}
+
+void packetSizeNegotiate(uint16_t min, uint16_t max)
+{
+    ps.min = min < MIN_PACKET_SIZE ? MIN_PACKET_SIZE : min > MAX_PACKET_SIZE ? MAX_PACKET_SIZE : min;
+    ps.max = max > MAX_PACKET_SIZE ? MAX_PACKET_SIZE : max;
+    if (ps.max < ps.min)
+        ps.max = ps.min;
+    clampSize();
+}
+
+uint16_t packetSizeCurrent(void)
+{
+    return ps.size;
+}
+
+void packetSizeDelivered(size_t len)
+{
+    ++ps.stats.packets;
+    ps.stats.bytes += len;
+    recordInterval();
+
+    ps.size += PACKET_SIZE_STEP;
+    clampSize();
+}
+
+void packetSizeLost(void)
+{
+    ++ps.stats.retries;
+    recordInterval();
+
+    ps.size /= 2;
+    clampSize();
+}
+
+void packetSizeStats(LinkStats *stats)
+{
+    *stats = ps.stats;
+}
+
+void packetSizeResetStats(void)
+{
+    memset(&ps.stats, 0, sizeof(ps.stats));
+    ps.lastPacket = 0;
+}
+
+#ifdef PACKET_SIZE_BENCH
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Simulated download pass over a UART with independent bit errors.
+ * Each request costs its frame time plus a fixed turnaround, and a
+ * packet with any flipped bit is thrown away and asked for again.
+ * Goodput is what got through over the whole pass.
+ */
+#define BAUD        115200
+#define TURNAROUND  0.05
+#define HEADER_LEN  3
+#define PASS_TIME   600.0
+
+static double frameTime(size_t len)
+{
+    // 10 bits per byte on the wire: start, 8 data, stop
+    return len * 10.0 / BAUD;
+}
+
+static double simulate(double ber, bool adaptive, unsigned seed)
+{
+    srand(seed);
+    ps.size = PACKET_SIZE;
+    packetSizeNegotiate(MIN_PACKET_SIZE, MAX_PACKET_SIZE);
+
+    double elapsed = 0;
+    uint64_t sent = 0;
+    while (true) {
+        size_t len = adaptive ? packetSizeCurrent() : PACKET_SIZE;
+
+        elapsed += TURNAROUND + frameTime(HEADER_LEN + 8) + frameTime(HEADER_LEN + len);
+        if (elapsed > PASS_TIME)
+            break;
+
+        double survive = pow(1 - ber, 8.0 * (HEADER_LEN + len));
+        if ((double) rand() / RAND_MAX < survive) {
+            sent += len;
+            packetSizeDelivered(len);
+        } else {
+            packetSizeLost();
+        }
+    }
+
+    return sent / PASS_TIME;
+}
+
+int main()
+{
+    const double bers[] = { 0, 1e-7, 1e-6, 3e-6, 1e-5, 3e-5, 1e-4 };
+
+    printf("%u baud, %.0f ms turnaround, %.0f s pass\n", BAUD, TURNAROUND * 1000, PASS_TIME);
+    printf("%8s  %14s  %14s  %7s\n", "ber", "fixed B/s", "adaptive B/s", "gain");
+
+    for (size_t i = 0; i < sizeof(bers) / sizeof(bers[0]); ++i) {
+        double fixed = 0, adaptive = 0;
+        for (unsigned seed = 1; seed <= 5; ++seed) {
+            fixed += simulate(bers[i], false, seed) / 5;
+            adaptive += simulate(bers[i], true, seed) / 5;
+        }
+        printf("%8.0e  %14.1f  %14.1f  %6.2fx\n", bers[i], fixed, adaptive, fixed > 0 ? adaptive / fixed : INFINITY);
+    }
+}
+
+#endif // PACKET_SIZE_BENCH
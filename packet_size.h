@@ -0,0 +1,44 @@
+#ifndef packet_size_h_INCLUDED
+#define packet_size_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 32 kb, the size packets start at before they adapt to the link
+// Kept out of commands.h so code that only needs the size doesn't pull in every command handler
+#define PACKET_SIZE 0x8000
+
+/*
+ * AIMD packet sizing: every packet that gets through grows the packet size
+ * by PACKET_SIZE_STEP, every one the ground has to ask for again halves it.
+ * Noisy passes settle on small packets that mostly survive, clean passes on
+ * large ones that spend less time turning the link around. Packets only
+ * grow past PACKET_SIZE, up to MAX_PACKET_SIZE, once the ground has said it
+ * can take them with NEGOTIATE_PACKET_SIZE.
+ */
+#define MIN_PACKET_SIZE  256
+#define MAX_PACKET_SIZE  0xF000
+#define PACKET_SIZE_STEP 1024
+
+typedef struct {
+    uint32_t packets;
+    uint32_t retries;
+    uint64_t bytes;
+    // Smoothed time between packet requests in microseconds
+    uint32_t interval;
+} LinkStats;
+
+// Set the range the ground is able to handle, clamped to the limits above
+void packetSizeNegotiate(uint16_t min, uint16_t max);
+
+uint16_t packetSizeCurrent(void);
+
+// Record a packet the ground received, or one it had to ask for again
+void packetSizeDelivered(size_t len);
+void packetSizeLost(void);
+
+// Statistics since the last call to packetSizeResetStats
+void packetSizeStats(LinkStats *stats);
+void packetSizeResetStats(void);
+
+#endif // packet_size_h_INCLUDED
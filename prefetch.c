@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include "prefetch.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * The ring holds the bytes [start, start + filled) of the file.
+ * The reader thread appends to the end, requestPacket consumes from the front.
+ * Seeking anywhere else bumps the generation so in-flight reads get discarded.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    pthread_t       thread;
+    bool            running;
+    bool            stopping;
+
+    int      fd;
+    char    *path;
+    uint64_t start;
+    size_t   filled;
+    bool     eof;
+    bool     failed;
+    unsigned generation;
+
+    uint8_t ring[PREFETCH_BYTES];
+} pf = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER,
+    .fd = -1
+};
+
+static void *readAhead(void *arg)
+{
+    pthread_mutex_lock(&pf.lock);
+    while (!pf.stopping) {
+        if (pf.filled == PREFETCH_BYTES || pf.eof || pf.failed) {
+            pthread_cond_wait(&pf.changed, &pf.lock);
+            continue;
+        }
+
+        // Fill the free space up to the end of the ring, the consumer never touches it
+        uint64_t readOffset = pf.start + pf.filled;
+        size_t pos = readOffset % PREFETCH_BYTES;
+        size_t space = PREFETCH_BYTES - pf.filled;
+        if (space > PREFETCH_BYTES - pos)
+            space = PREFETCH_BYTES - pos;
+        unsigned generation = pf.generation;
+        int fd = pf.fd;
+
+        pthread_mutex_unlock(&pf.lock);
+        ssize_t result = pread(fd, pf.ring + pos, space, readOffset);
+        // Hint the kernel to start on what comes after the ring
+        posix_fadvise(fd, readOffset + space, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+        pthread_mutex_lock(&pf.lock);
+
+        if (generation != pf.generation)
+            continue;
+
+        if (result < 0) {
+            perror("Error reading ahead");
+            pf.failed = true;
+        } else if (result == 0) {
+            pf.eof = true;
+        } else {
+            pf.filled += result;
+        }
+        pthread_cond_broadcast(&pf.changed);
+    }
+    pthread_mutex_unlock(&pf.lock);
+
+    return NULL;
+}
+
+// Caller holds the lock
+static void resetTo(uint64_t offset)
+{
+    pf.start = offset;
+    pf.filled = 0;
+    pf.eof = false;
+    pf.failed = false;
+    ++pf.generation;
+    pthread_cond_broadcast(&pf.changed);
+}
+
+void prefetchStart(const char *path, uint64_t offset)
+{
+    prefetchStop();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file for read-ahead");
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    readahead(fd, offset, PREFETCH_BYTES);
+
+    pthread_mutex_lock(&pf.lock);
+    pf.fd = fd;
+    pf.path = strdup(path);
+    pf.stopping = false;
+    resetTo(offset);
+
+    if (pthread_create(&pf.thread, NULL, readAhead, NULL) != 0) {
+        perror("Error creating read-ahead thread");
+        close(pf.fd);
+        free(pf.path);
+        pf.fd = -1;
+        pf.path = NULL;
+    } else {
+        pf.running = true;
+    }
+    pthread_mutex_unlock(&pf.lock);
+}
+
+void prefetchStop(void)
+{
+    pthread_mutex_lock(&pf.lock);
+    if (!pf.running) {
+        pthread_mutex_unlock(&pf.lock);
+        return;
+    }
+    pf.stopping = true;
+    pthread_cond_broadcast(&pf.changed);
+    pthread_mutex_unlock(&pf.lock);
+
+    pthread_join(pf.thread, NULL);
+
+    close(pf.fd);
+    free(pf.path);
+    pf.fd = -1;
+    pf.path = NULL;
+    pf.running = false;
+}
+
+bool prefetchRead(const char *path, uint64_t offset, void *buf, size_t len)
+{
+    // After a listener restart the download is still on disk, so pick it back up
+    if (!pf.running || strcmp(pf.path, path) != 0) {
+        prefetchStart(path, offset);
+        if (!pf.running)
+            return false;
+    }
+
+    if (len > PREFETCH_BYTES)
+        return false;
+
+    pthread_mutex_lock(&pf.lock);
+
+    // Skip forward within the ring, anything else is a seek
+    if (offset >= pf.start && offset <= pf.start + pf.filled) {
+        pf.filled -= offset - pf.start;
+        pf.start = offset;
+        pthread_cond_broadcast(&pf.changed);
+    } else {
+        resetTo(offset);
+    }
+
+    // The reader is already on these bytes, waiting for it is no slower than reading them here
+    while (pf.filled < len && !pf.eof && !pf.failed)
+        pthread_cond_wait(&pf.changed, &pf.lock);
+
+    if (pf.filled < len) {
+        pthread_mutex_unlock(&pf.lock);
+        return false;
+    }
+
+    size_t pos = offset % PREFETCH_BYTES;
+    size_t first = len < PREFETCH_BYTES - pos ? len : PREFETCH_BYTES - pos;
+    memcpy(buf, pf.ring + pos, first);
+    memcpy((uint8_t *) buf + first, pf.ring, len - first);
+
+    pf.start += len;
+    pf.filled -= len;
+    pthread_cond_broadcast(&pf.changed);
+
+    pthread_mutex_unlock(&pf.lock);
+    return true;
+}
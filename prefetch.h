@@ -0,0 +1,22 @@
+#ifndef prefetch_h_INCLUDED
+#define prefetch_h_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet_size.h"
+
+// Number of packets read ahead of the ground on the active download
+#define PREFETCH_PACKETS 4
+#define PREFETCH_BYTES   (PREFETCH_PACKETS * PACKET_SIZE)
+
+// Start reading path from offset on the background thread, replacing any previous file
+void prefetchStart(const char *path, uint64_t offset);
+void prefetchStop(void);
+
+// Copy len bytes of path at offset out of the read-ahead ring and consume them
+// Returns false if they can't be served from memory, the caller must read them itself
+bool prefetchRead(const char *path, uint64_t offset, void *buf, size_t len);
+
+#endif // prefetch_h_INCLUDED
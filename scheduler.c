@@ -0,0 +1,471 @@
+#include "scheduler.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+/*
+ * Queue file format
+ *   4 bytes for the next id to hand out
+ *   repeated for each entry:
+ *     8 bytes for the unix time to run at
+ *     4 bytes for the id
+ *     1 byte set once the entry has run
+ *     1 byte for command code
+ *     2 bytes for payload length
+ *     n bytes for payload
+ *
+ * Entries are appended, and marked done in place when they run, so
+ * neither adding nor running one rewrites the file. It's compacted once
+ * the done entries outnumber the pending ones.
+ *
+ * In memory only a min-heap of (time, id, file offset) is kept, so
+ * finding and running the next entry stays O(log n).
+ */
+
+#define ENTRY_HEADER_LEN 16
+#define DONE_OFFSET      12
+
+// Most a stored reply payload can be and still fit in a FETCH_RESULTS reply after its
+// id, code and length
+#define RESULT_ROOM      (UINT16_MAX - 7)
+
+typedef struct {
+    uint64_t time;
+    uint32_t id;
+    off_t    offset;
+} Entry;
+
+static struct {
+    int      fd;
+    int      timerfd;
+    uint32_t nextId;
+    size_t   doneCount;
+
+    Entry   *heap;
+    size_t   count;
+    size_t   capacity;
+} sched = {
+    .fd = -1,
+    .timerfd = -1
+};
+
+static bool entryBefore(const Entry *a, const Entry *b)
+{
+    return a->time < b->time || (a->time == b->time && a->id < b->id);
+}
+
+static void heapPush(Entry e)
+{
+    if (sched.count == sched.capacity) {
+        sched.capacity = sched.capacity ? sched.capacity * 2 : 64;
+        sched.heap = realloc(sched.heap, sched.capacity * sizeof(Entry));
+    }
+
+    size_t i = sched.count++;
+    while (i > 0 && entryBefore(&e, &sched.heap[(i - 1) / 2])) {
+        sched.heap[i] = sched.heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sched.heap[i] = e;
+}
+
+static Entry heapPop()
+{
+    Entry top = sched.heap[0];
+    Entry last = sched.heap[--sched.count];
+
+    size_t i = 0;
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= sched.count)
+            break;
+        if (child + 1 < sched.count && entryBefore(&sched.heap[child + 1], &sched.heap[child]))
+            ++child;
+        if (!entryBefore(&sched.heap[child], &last))
+            break;
+        sched.heap[i] = sched.heap[child];
+        i = child;
+    }
+    sched.heap[i] = last;
+
+    return top;
+}
+
+static void armTimer()
+{
+    // A zero it_value disarms the timer, so an entry due at time 0 is pushed to 1
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (sched.count > 0)
+        its.it_value.tv_sec = sched.heap[0].time > 0 ? sched.heap[0].time : 1;
+
+    if (timerfd_settime(sched.timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+        perror("Error arming schedule timer");
+}
+
+static int readAll(int fd, void *buf, size_t len, off_t offset)
+{
+    ssize_t result = pread(fd, buf, len, offset);
+    if (result < 0)
+        return -1;
+    if ((size_t) result != len) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int writeAll(int fd, const void *buf, size_t len, off_t offset)
+{
+    ssize_t result = pwrite(fd, buf, len, offset);
+    if (result < 0)
+        return -1;
+    if ((size_t) result != len) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// Scan the queue file, rebuilding the heap from the pending entries
+static int loadQueue()
+{
+    sched.count = 0;
+    sched.doneCount = 0;
+
+    struct stat st;
+    if (fstat(sched.fd, &st) == -1)
+        return -1;
+
+    if (st.st_size < 4) {
+        sched.nextId = 0;
+        return writeAll(sched.fd, &sched.nextId, 4, 0);
+    }
+
+    if (readAll(sched.fd, &sched.nextId, 4, 0) == -1)
+        return -1;
+
+    off_t offset = 4;
+    while (offset + ENTRY_HEADER_LEN <= st.st_size) {
+        uint8_t header[ENTRY_HEADER_LEN];
+        if (readAll(sched.fd, header, ENTRY_HEADER_LEN, offset) == -1)
+            return -1;
+
+        Entry e;
+        uint16_t len;
+        memcpy(&e.time, header, 8);
+        memcpy(&e.id, header + 8, 4);
+        memcpy(&len, header + 14, 2);
+        e.offset = offset;
+
+        // A torn append from a crash is dropped
+        if (offset + ENTRY_HEADER_LEN + len > st.st_size)
+            break;
+
+        if (header[DONE_OFFSET])
+            ++sched.doneCount;
+        else
+            heapPush(e);
+
+        offset += ENTRY_HEADER_LEN + len;
+    }
+
+    if (offset != st.st_size && ftruncate(sched.fd, offset) == -1)
+        return -1;
+
+    return 0;
+}
+
+// Copy the pending entries into a fresh file and swap it in
+static int compactQueue()
+{
+    int out = open(SCHEDULE_QUEUE ".tmp", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+        return -1;
+
+    bool failed = writeAll(out, &sched.nextId, 4, 0) == -1;
+    off_t outOffset = 4;
+    uint8_t buf[ENTRY_HEADER_LEN + UINT16_MAX];
+
+    for (size_t i = 0; i < sched.count && !failed; ++i) {
+        Entry *e = &sched.heap[i];
+        uint16_t len;
+        failed = readAll(sched.fd, buf, ENTRY_HEADER_LEN, e->offset) == -1;
+        if (failed)
+            break;
+        memcpy(&len, buf + 14, 2);
+        failed = readAll(sched.fd, buf + ENTRY_HEADER_LEN, len, e->offset + ENTRY_HEADER_LEN) == -1
+            || writeAll(out, buf, ENTRY_HEADER_LEN + len, outOffset) == -1;
+        e->offset = outOffset;
+        outOffset += ENTRY_HEADER_LEN + len;
+    }
+
+    if (failed || fsync(out) == -1 || rename(SCHEDULE_QUEUE ".tmp", SCHEDULE_QUEUE) == -1) {
+        int saved = errno;
+        close(out);
+        unlink(SCHEDULE_QUEUE ".tmp");
+        // The heap offsets may be half rewritten, so go back to what's on disk
+        loadQueue();
+        errno = saved;
+        return -1;
+    }
+
+    close(sched.fd);
+    sched.fd = out;
+    sched.doneCount = 0;
+    return 0;
+}
+
+int schedulerInit(void)
+{
+    sched.fd = open(SCHEDULE_QUEUE, O_RDWR | O_CREAT, 0644);
+    if (sched.fd < 0) {
+        perror("Error opening " SCHEDULE_QUEUE);
+        return -1;
+    }
+
+    if (loadQueue() == -1) {
+        perror("Error loading " SCHEDULE_QUEUE);
+        return -1;
+    }
+
+    sched.timerfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (sched.timerfd < 0) {
+        perror("Error creating schedule timer");
+        return -1;
+    }
+
+    armTimer();
+    return sched.timerfd;
+}
+
+int schedulerAdd(uint64_t time, uint8_t code, const uint8_t *payload, uint16_t len, uint32_t *id)
+{
+    if (sched.fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(sched.fd, &st) == -1)
+        return -1;
+
+    Entry e;
+    e.time = time;
+    e.id = sched.nextId;
+    e.offset = st.st_size;
+
+    uint8_t header[ENTRY_HEADER_LEN];
+    memcpy(header, &e.time, 8);
+    memcpy(header + 8, &e.id, 4);
+    header[DONE_OFFSET] = 0;
+    header[13] = code;
+    memcpy(header + 14, &len, 2);
+
+    uint32_t nextId = sched.nextId + 1;
+    if (writeAll(sched.fd, header, ENTRY_HEADER_LEN, e.offset) == -1
+        || writeAll(sched.fd, payload, len, e.offset + ENTRY_HEADER_LEN) == -1
+        || writeAll(sched.fd, &nextId, 4, 0) == -1
+        || fdatasync(sched.fd) == -1) {
+        int saved = errno;
+        if (ftruncate(sched.fd, e.offset) == -1)
+            perror("Error truncating " SCHEDULE_QUEUE);
+        errno = saved;
+        return -1;
+    }
+
+    sched.nextId = nextId;
+    heapPush(e);
+    armTimer();
+
+    *id = e.id;
+    return 0;
+}
+
+static void storeResult(uint32_t id, const Message *reply)
+{
+    // results file format, repeated for each result:
+    //   4 bytes for the id
+    //   1 byte for reply code
+    //   2 bytes for payload length
+    //   n bytes for payload
+    FILE *fp = fopen(SCHEDULE_RESULTS, "a");
+    if (fp == NULL) {
+        perror("Error opening " SCHEDULE_RESULTS);
+        return;
+    }
+
+    if (fwrite(&id, 4, 1, fp) != 1
+        || fwrite(&reply->code, 1, 1, fp) != 1
+        || fwrite(&reply->payloadLen, 2, 1, fp) != 1
+        || (reply->payloadLen > 0 && fwrite(reply->payload, reply->payloadLen, 1, fp) != 1))
+        perror("Error writing " SCHEDULE_RESULTS);
+
+    fclose(fp);
+}
+
+void schedulerRun(void)
+{
+    uint64_t expirations;
+    if (read(sched.timerfd, &expirations, 8) < 0 && errno != EAGAIN)
+        perror("Error reading schedule timer");
+
+    uint64_t now = time(NULL);
+    uint8_t *payload = malloc(UINT16_MAX);
+
+    while (sched.count > 0 && sched.heap[0].time <= now) {
+        Entry e = heapPop();
+
+        uint8_t header[ENTRY_HEADER_LEN];
+        uint16_t len;
+        Message reply;
+        if (readAll(sched.fd, header, ENTRY_HEADER_LEN, e.offset) == -1) {
+            reply = EMPTY_MESSAGE(ERROR_READING_FILE);
+        } else {
+            memcpy(&len, header + 14, 2);
+            uint8_t code = header[13];
+
+            // Mark it done before running it, so a command that crashes us isn't rerun forever
+            uint8_t done = 1;
+            if (readAll(sched.fd, payload, len, e.offset + ENTRY_HEADER_LEN) == -1)
+                reply = EMPTY_MESSAGE(ERROR_READING_FILE);
+            else if (writeAll(sched.fd, &done, 1, e.offset + DONE_OFFSET) == -1 || fdatasync(sched.fd) == -1)
+                reply = EMPTY_MESSAGE(ERROR_WRITING_FILE);
+            else if (code > MAX_COMMAND_VAL)
+                reply = EMPTY_MESSAGE(ERROR_INVALID_COMMAND);
+            else
+                reply = runCommandWithin(code, payload, len, RESULT_ROOM);
+        }
+
+        // A result too long to ever be fetched would hold back every result after it
+        if (reply.payloadLen > RESULT_ROOM) {
+            free(reply.payload);
+            reply = EMPTY_MESSAGE(ERROR_BATCH_TOO_LONG);
+        }
+
+        ++sched.doneCount;
+
+        printf("Ran scheduled command %u: %s\n", e.id, reply_strs[reply.code]);
+        storeResult(e.id, &reply);
+        free(reply.payload);
+    }
+
+    free(payload);
+
+    if (sched.doneCount > 64 && sched.doneCount > sched.count && compactQueue() == -1)
+        perror("Error compacting " SCHEDULE_QUEUE);
+
+    armTimer();
+}
+
+// Drop the results up to and including the one with id ackId, everything before it was received
+static int dropResults(uint8_t *data, size_t len, uint32_t ackId, size_t *kept)
+{
+    size_t offset = 0, cut = 0;
+    while (len - offset >= 7) {
+        uint32_t id;
+        uint16_t resultLen;
+        memcpy(&id, data + offset, 4);
+        memcpy(&resultLen, data + offset + 5, 2);
+        if (len - offset - 7 < resultLen)
+            break;
+        offset += 7 + resultLen;
+        if (id == ackId) {
+            cut = offset;
+            break;
+        }
+    }
+
+    // An id that isn't there (already dropped, or never run) drops nothing
+    *kept = cut;
+    if (cut == 0)
+        return 0;
+
+    if (cut == len)
+        return remove(SCHEDULE_RESULTS);
+
+    FILE *fp = fopen(SCHEDULE_RESULTS ".tmp", "w");
+    if (fp == NULL)
+        return -1;
+
+    bool written = fwrite(data + cut, len - cut, 1, fp) == 1;
+    if (fclose(fp) == EOF || !written || rename(SCHEDULE_RESULTS ".tmp", SCHEDULE_RESULTS) == -1) {
+        remove(SCHEDULE_RESULTS ".tmp");
+        return -1;
+    }
+
+    return 0;
+}
+
+int schedulerFetchResults(bool acked, uint32_t ackId, Message *m)
+{
+    FILE *fp = fopen(SCHEDULE_RESULTS, "r");
+    if (fp == NULL) {
+        if (errno != ENOENT)
+            return -1;
+        *m = EMPTY_MESSAGE(SUCCESS);
+        return 0;
+    }
+
+    uint8_t *data = NULL;
+    size_t len = 0;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        data = realloc(data, len + n);
+        memcpy(data + len, chunk, n);
+        len += n;
+    }
+    bool failed = ferror(fp);
+    fclose(fp);
+    if (failed) {
+        free(data);
+        return -1;
+    }
+
+    // Results are only removed once the ground says it has them, a lost reply just gets them sent again
+    size_t start = 0;
+    if (acked && dropResults(data, len, ackId, &start) == -1) {
+        free(data);
+        return -1;
+    }
+
+    // Take whole results until the next one wouldn't fit
+    m->code = SUCCESS;
+    m->payloadLen = 0;
+    m->payload = malloc(UINT16_MAX);
+
+    size_t offset = start;
+    while (len - offset >= 7) {
+        uint16_t resultLen;
+        memcpy(&resultLen, data + offset + 5, 2);
+        if (len - offset - 7 < resultLen)
+            break;
+
+        // One stored before results were kept within RESULT_ROOM goes out as too long, so it can be acknowledged
+        uint16_t sentLen = resultLen > RESULT_ROOM ? 0 : resultLen;
+        if ((size_t) m->payloadLen + 7 + sentLen > UINT16_MAX)
+            break;
+
+        memcpy(m->payload + m->payloadLen, data + offset, 7);
+        if (sentLen != resultLen) {
+            m->payload[m->payloadLen + 4] = ERROR_BATCH_TOO_LONG;
+            memcpy(m->payload + m->payloadLen + 5, &sentLen, 2);
+        }
+        memcpy(m->payload + m->payloadLen + 7, data + offset + 7, sentLen);
+        m->payloadLen += 7 + sentLen;
+        offset += 7 + resultLen;
+    }
+
+    free(data);
+    return 0;
+}
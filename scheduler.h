@@ -0,0 +1,30 @@
+#ifndef scheduler_h_INCLUDED
+#define scheduler_h_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "commands.h"
+
+/*
+ * Time-tagged commands, run by the listener at an absolute unix time.
+ * The queue is kept on disk so it survives reboots, and the replies are
+ * kept in the results file until the ground acknowledges them.
+ */
+#define SCHEDULE_QUEUE   "schedule-queue"
+#define SCHEDULE_RESULTS "schedule-results"
+
+// Returns the timerfd that becomes readable when commands are due, or -1 on failure
+int schedulerInit(void);
+
+// Returns -1 with errno set on failure
+int schedulerAdd(uint64_t time, uint8_t code, const uint8_t *payload, uint16_t len, uint32_t *id);
+
+// Run every command that is due, called when the timerfd is readable
+void schedulerRun(void);
+
+// Drop the stored results up to the one with id ackId if acked, then put as many of the rest
+// as fit in a reply into m, returns -1 on failure
+int schedulerFetchResults(bool acked, uint32_t ackId, Message *m);
+
+#endif // scheduler_h_INCLUDED
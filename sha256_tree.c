@@ -0,0 +1,136 @@
+#include "sha256_tree.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include "sha256_utils.h"
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    size_t leafSize;
+    size_t leafCount;
+    uint8_t (*leaves)[32];
+    // Index of the next leaf to be claimed by a worker
+    atomic_size_t next;
+} TreeJob;
+
+size_t sha256treeLeafCount(size_t len, size_t leafSize)
+{
+    // An empty input still has a single (empty) leaf
+    if (len == 0)
+        return 1;
+    return (len + leafSize - 1) / leafSize;
+}
+
+static void *hashLeaves(void *arg)
+{
+    TreeJob *job = arg;
+
+    // Leaves are claimed one at a time so uneven workers still finish together
+    size_t i;
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->leafCount) {
+        size_t start = i * job->leafSize;
+        size_t len = job->len - start < job->leafSize ? job->len - start : job->leafSize;
+        sha256calc(job->data + start, len, job->leaves[i]);
+    }
+
+    return NULL;
+}
+
+int sha256tree(const void *data, size_t len, size_t leafSize, unsigned threads,
+               uint8_t root[32], uint8_t (*leaves)[32])
+{
+    TreeJob job;
+    job.data = data;
+    job.len = len;
+    job.leafSize = leafSize;
+    job.leafCount = sha256treeLeafCount(len, leafSize);
+    job.leaves = leaves != NULL ? leaves : malloc(job.leafCount * 32);
+    atomic_init(&job.next, 0);
+
+    if (job.leaves == NULL)
+        return -1;
+
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? cores : 1;
+    }
+    if (threads > job.leafCount)
+        threads = job.leafCount;
+
+    // The calling thread works too, so only threads - 1 are spawned
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    unsigned spawned = 0;
+    for (unsigned t = 1; t < threads; ++t) {
+        if (pthread_create(&workers[spawned], NULL, hashLeaves, &job) != 0) {
+            perror("Error creating hash thread");
+            break;
+        }
+        ++spawned;
+    }
+
+    hashLeaves(&job);
+
+    for (unsigned t = 0; t < spawned; ++t)
+        pthread_join(workers[t], NULL);
+    free(workers);
+
+    sha256calc(job.leaves, job.leafCount * 32, root);
+
+    if (leaves == NULL)
+        free(job.leaves);
+
+    return 0;
+}
+
+#ifdef SHA256_TREE_BENCH
+
+#include <time.h>
+
+#include "packet_size.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    size_t len = (argc > 1 ? strtoul(argv[1], NULL, 0) : 64) << 20;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    uint8_t *data = malloc(len);
+    for (size_t i = 0; i < len; ++i)
+        data[i] = i * 2654435761u >> 24;
+
+    uint8_t shaSum[32];
+    double start = now();
+    sha256calc(data, len, shaSum);
+    double serial = now() - start;
+
+    printf("%zu MiB, %ld cores, %u byte leaves\n", len >> 20, cores, PACKET_SIZE);
+    printf("plain sha256:      %8.3f s  %8.1f MiB/s\n", serial, (len >> 20) / serial);
+
+    // Powers of two up to the core count, then the core count itself
+    for (long threads = 1; ; threads = threads * 2 < cores ? threads * 2 : cores) {
+        start = now();
+        sha256tree(data, len, PACKET_SIZE, threads, shaSum, NULL);
+        double tree = now() - start;
+        printf("tree, %2ld threads:  %8.3f s  %8.1f MiB/s  %5.2fx\n",
+               threads, tree, (len >> 20) / tree, serial / tree);
+
+        if (threads == cores)
+            break;
+    }
+
+    free(data);
+}
+
+#endif // SHA256_TREE_BENCH
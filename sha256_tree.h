@@ -0,0 +1,21 @@
+#ifndef sha256_tree_h_INCLUDED
+#define sha256_tree_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Tree hash: the data is split into leafSize chunks which are hashed
+ * independently (and so in parallel), and the root is the sha256 of
+ * the concatenated leaf sums. A receiver can check every leaf as it
+ * arrives and the full set of leaves against the root at the end.
+ */
+
+size_t sha256treeLeafCount(size_t len, size_t leafSize);
+
+// threads == 0 uses one thread per online core
+// leaves may be NULL, otherwise it must hold sha256treeLeafCount(len, leafSize) sums
+int sha256tree(const void *data, size_t len, size_t leafSize, unsigned threads,
+               uint8_t root[32], uint8_t (*leaves)[32]);
+
+#endif // sha256_tree_h_INCLUDED
@@ -1,8 +1,11 @@
 #include "sha256_utils.h"
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#include <unistd.h>
+
 #include <sha256.h>
 
 void sha256calc(const void *data, size_t len, uint8_t shaSum[32])
@@ -14,6 +17,26 @@ void sha256calc(const void *data, size_t len, uint8_t shaSum[32])
     sha256_final(&shaCtx, (BYTE *) shaSum);
 }
 
+int sha256fd(int fd, uint8_t shaSum[32])
+{
+    SHA256_CTX shaCtx;
+    uint8_t buf[0x10000];
+    ssize_t len;
+
+    sha256_init(&shaCtx);
+    while ((len = read(fd, buf, sizeof(buf))) != 0) {
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        sha256_update(&shaCtx, buf, len);
+    }
+    sha256_final(&shaCtx, (BYTE *) shaSum);
+
+    return 0;
+}
+
 void sha256str(char shaStr[65], const uint8_t shaSum[32])
 {
     for (size_t i = 0; i < 32; ++i)
@@ -83,8 +106,8 @@ int main(int argc, char **argv)
 
     data = readFile(argv[1], &len);
 
-    calculateSHA256(data, len, shaSum);
-    sha256Str(shaStr, shaSum);
+    sha256calc(data, len, shaSum);
+    sha256str(shaStr, shaSum);
 
     printf("%s\n", shaStr);
 
@@ -6,6 +6,8 @@
 #include <stdint.h>
 
 void sha256calc(const void *data, size_t len, uint8_t shaSum[32]);
+// Hash everything from the fd's current position to its end, returns -1 on read errors
+int sha256fd(int fd, uint8_t shaSum[32]);
 void sha256str(char shaStr[65], const uint8_t shaSum[32]);
 bool sha256cmp(const uint8_t shaSum1[32], const uint8_t shaSum2[32]);
 
@@ -0,0 +1,122 @@
+#include "sha_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t  mtimeNs;
+    // LRU stamp, zero marks an unused slot
+    uint64_t lastUsed;
+    uint8_t  shaSum[32];
+} CacheEntry;
+
+static int64_t mtimeNs(const struct stat *st)
+{
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static bool entryMatches(const CacheEntry *e, const struct stat *st)
+{
+    return e->lastUsed != 0
+        && e->dev == (uint64_t) st->st_dev
+        && e->ino == (uint64_t) st->st_ino
+        && e->size == (uint64_t) st->st_size
+        && e->mtimeNs == mtimeNs(st);
+}
+
+// Load the whole cache table, missing or short files read as empty slots
+static int loadCache(CacheEntry entries[SHA_CACHE_ENTRIES], int flags)
+{
+    memset(entries, 0, sizeof(CacheEntry) * SHA_CACHE_ENTRIES);
+
+    int fd = open(SHA_CACHE_FILE, flags, 0644);
+    if (fd < 0)
+        return -1;
+
+    if (pread(fd, entries, sizeof(CacheEntry) * SHA_CACHE_ENTRIES, 0) < 0) {
+        perror("Error reading sha cache");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static uint64_t newestStamp(const CacheEntry entries[SHA_CACHE_ENTRIES])
+{
+    uint64_t newest = 0;
+    for (size_t i = 0; i < SHA_CACHE_ENTRIES; ++i) {
+        if (entries[i].lastUsed > newest)
+            newest = entries[i].lastUsed;
+    }
+    return newest;
+}
+
+static void writeEntry(int fd, const CacheEntry *e, size_t slot)
+{
+    if (pwrite(fd, e, sizeof(CacheEntry), slot * sizeof(CacheEntry)) != sizeof(CacheEntry))
+        perror("Error writing sha cache");
+}
+
+bool shaCacheLookup(const struct stat *st, uint8_t shaSum[32])
+{
+    CacheEntry entries[SHA_CACHE_ENTRIES];
+
+    int fd = loadCache(entries, O_RDWR);
+    if (fd < 0)
+        return false;
+
+    for (size_t i = 0; i < SHA_CACHE_ENTRIES; ++i) {
+        if (entryMatches(&entries[i], st)) {
+            memcpy(shaSum, entries[i].shaSum, 32);
+
+            // Bump the entry so it's the last to be evicted
+            entries[i].lastUsed = newestStamp(entries) + 1;
+            writeEntry(fd, &entries[i], i);
+
+            close(fd);
+            return true;
+        }
+    }
+
+    close(fd);
+    return false;
+}
+
+void shaCacheStore(const struct stat *st, const uint8_t shaSum[32])
+{
+    CacheEntry entries[SHA_CACHE_ENTRIES];
+
+    int fd = loadCache(entries, O_RDWR | O_CREAT);
+    if (fd < 0)
+        return;
+
+    // Replace a stale entry for the same file if there is one, otherwise the least recently used slot
+    size_t slot = 0;
+    for (size_t i = 0; i < SHA_CACHE_ENTRIES; ++i) {
+        const CacheEntry *e = &entries[i];
+        if (e->lastUsed != 0 && e->dev == (uint64_t) st->st_dev && e->ino == (uint64_t) st->st_ino) {
+            slot = i;
+            break;
+        }
+        if (e->lastUsed < entries[slot].lastUsed)
+            slot = i;
+    }
+
+    CacheEntry e;
+    e.dev = st->st_dev;
+    e.ino = st->st_ino;
+    e.size = st->st_size;
+    e.mtimeNs = mtimeNs(st);
+    e.lastUsed = newestStamp(entries) + 1;
+    memcpy(e.shaSum, shaSum, 32);
+
+    writeEntry(fd, &e, slot);
+    close(fd);
+}
@@ -0,0 +1,17 @@
+#ifndef sha_cache_h_INCLUDED
+#define sha_cache_h_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+
+// Persistent cache of file sha256 sums, so unchanged files don't get rehashed.
+// Entries are keyed on (device, inode, size, mtime) and evicted least recently used first.
+#define SHA_CACHE_FILE    "sha-cache"
+#define SHA_CACHE_ENTRIES 64
+
+bool shaCacheLookup(const struct stat *st, uint8_t shaSum[32]);
+void shaCacheStore(const struct stat *st, const uint8_t shaSum[32]);
+
+#endif // sha_cache_h_INCLUDED
@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include "sparse.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#define SCAN_CHUNK 0x10000
+
+static uint8_t scanBuf[SCAN_CHUNK];
+
+size_t zeroPrefix(const uint8_t *buf, size_t len)
+{
+    // Whole 64 byte blocks are OR-ed together a word at a time, which compilers turn into vector code
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint64_t acc = 0;
+        for (size_t j = 0; j < 64; j += 8) {
+            uint64_t word;
+            memcpy(&word, buf + i + j, 8);
+            acc |= word;
+        }
+        if (acc != 0)
+            break;
+    }
+
+    // Then find the first set byte in the block that had one
+    while (i < len && buf[i] == 0)
+        ++i;
+
+    return i;
+}
+
+uint64_t sparseZeroRun(int fd, uint64_t offset, uint64_t len, int mode)
+{
+    if (mode == SPARSE_OFF || offset >= len)
+        return 0;
+
+    // A hole reads back as zeros without being stored, ENXIO means there's no data past offset
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    if (data == -1 && errno == ENXIO)
+        return len - offset;
+    if (data > (off_t) offset)
+        return (uint64_t) data < len ? data - offset : len - offset;
+
+    if (mode != SPARSE_ZEROS)
+        return 0;
+
+    // Filesystems without hole support report the whole file as data, and the scan still works
+    off_t hole = lseek(fd, offset, SEEK_HOLE);
+    uint64_t end = hole == -1 || (uint64_t) hole > len ? len : (uint64_t) hole;
+    if (end - offset > ZERO_SCAN_LIMIT)
+        end = offset + ZERO_SCAN_LIMIT;
+
+    uint64_t run = 0;
+    while (offset + run < end) {
+        size_t want = end - offset - run < SCAN_CHUNK ? end - offset - run : SCAN_CHUNK;
+        ssize_t result = pread(fd, scanBuf, want, offset + run);
+        if (result <= 0)
+            break;
+
+        size_t zeros = zeroPrefix(scanBuf, result);
+        run += zeros;
+        if (zeros < (size_t) result)
+            break;
+    }
+
+    return run >= MIN_ZERO_RUN ? run : 0;
+}
@@ -0,0 +1,28 @@
+#ifndef sparse_h_INCLUDED
+#define sparse_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Finding the zeros of a download so they can be sent as a length instead of
+ * data. Holes are found with SEEK_DATA and cost nothing to skip. Zero runs in
+ * allocated data have to be read to be found, so that's a separate mode.
+ */
+#define SPARSE_OFF   0
+#define SPARSE_HOLES 1
+#define SPARSE_ZEROS 2
+
+// Shorter runs are sent as data, a reply of their own costs more than they save
+#define MIN_ZERO_RUN 4096
+
+// Zero runs in data are scanned this far at most per request, so a request never stalls the link for long
+#define ZERO_SCAN_LIMIT (16 << 20)
+
+// Length of the zeros starting at offset in the first len bytes of the file, 0 if there's data there
+uint64_t sparseZeroRun(int fd, uint64_t offset, uint64_t len, int mode);
+
+// Length of the all-zero run at the start of buf
+size_t zeroPrefix(const uint8_t *buf, size_t len);
+
+#endif // sparse_h_INCLUDED
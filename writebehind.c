@@ -0,0 +1,184 @@
+#include "writebehind.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct {
+    uint8_t  policy;
+    uint32_t value;
+
+    int      fd;
+    size_t   buffered;
+    uint64_t durable;
+    uint64_t written;
+
+    // Progress since the last fsync
+    uint32_t packets;
+    uint64_t lastSync;
+
+    uint8_t buf[WRITEBEHIND_BYTES];
+} wb = {
+    .policy = DEFAULT_SYNC_POLICY,
+    .value = DEFAULT_SYNC_VALUE,
+    .fd = -1
+};
+
+static uint64_t nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int flushBuffer()
+{
+    size_t offset = 0;
+    while (offset < wb.buffered) {
+        ssize_t result = write(wb.fd, wb.buf + offset, wb.buffered - offset);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error writing upload data");
+            return -1;
+        }
+        offset += result;
+    }
+
+    wb.written += wb.buffered;
+    wb.buffered = 0;
+    return 0;
+}
+
+static int openUpload(const char *path)
+{
+    wb.fd = open(path, O_WRONLY | O_APPEND);
+    if (wb.fd < 0)
+        return -1;
+
+    // Whatever an earlier run left in the file is made durable before it's counted
+    struct stat st;
+    if (fsync(wb.fd) == -1 || fstat(wb.fd, &st) == -1) {
+        close(wb.fd);
+        wb.fd = -1;
+        return -1;
+    }
+
+    wb.buffered = 0;
+    wb.written = st.st_size;
+    wb.durable = st.st_size;
+    wb.packets = 0;
+    wb.lastSync = nowMs();
+    return 0;
+}
+
+void writeBehindSetPolicy(uint8_t policy, uint32_t value)
+{
+    wb.policy = policy;
+    wb.value = value;
+}
+
+int writeBehindSync(void)
+{
+    if (wb.fd < 0)
+        return 0;
+
+    if (flushBuffer() == -1)
+        return -1;
+    if (fsync(wb.fd) == -1) {
+        perror("Error syncing upload data");
+        return -1;
+    }
+
+    wb.durable = wb.written;
+    wb.packets = 0;
+    wb.lastSync = nowMs();
+    return 0;
+}
+
+int writeBehindAppend(const char *path, const void *data, size_t len)
+{
+    if (wb.fd < 0 && openUpload(path) == -1)
+        return -1;
+
+    const uint8_t *bytes = data;
+    while (len > 0) {
+        size_t n = WRITEBEHIND_BYTES - wb.buffered;
+        if (n > len)
+            n = len;
+        memcpy(wb.buf + wb.buffered, bytes, n);
+        wb.buffered += n;
+        bytes += n;
+        len -= n;
+
+        if (wb.buffered == WRITEBEHIND_BYTES && flushBuffer() == -1)
+            return -1;
+    }
+
+    ++wb.packets;
+
+    bool sync;
+    switch (wb.policy) {
+    case SYNC_EVERY_PACKETS:
+        sync = wb.packets >= wb.value;
+        break;
+    case SYNC_EVERY_BYTES:
+        sync = wb.written + wb.buffered - wb.durable >= wb.value;
+        break;
+    case SYNC_EVERY_MS:
+        // Only checked as packets arrive, an idle upload keeps its tail until finalize
+        sync = nowMs() - wb.lastSync >= wb.value;
+        break;
+    default:
+        sync = false;
+        break;
+    }
+
+    return sync ? writeBehindSync() : 0;
+}
+
+void writeBehindClose(void)
+{
+    if (wb.fd < 0)
+        return;
+
+    // Anything not yet synced is dropped, the caller syncs first if it wants to keep it
+    close(wb.fd);
+    wb.fd = -1;
+    wb.buffered = 0;
+    wb.written = 0;
+    wb.durable = 0;
+}
+
+uint64_t writeBehindDurable(void)
+{
+    return wb.durable;
+}
+
+int64_t writeBehindResume(const char *path, uint64_t limit)
+{
+    if (wb.fd < 0 && openUpload(path) == -1)
+        return -1;
+
+    if (flushBuffer() == -1)
+        return -1;
+
+    // Appends land at the new end, O_APPEND doesn't keep the old one
+    if (limit < wb.written) {
+        if (ftruncate(wb.fd, limit) == -1) {
+            perror("Error truncating upload data");
+            return -1;
+        }
+        wb.written = limit;
+    }
+
+    if (writeBehindSync() == -1)
+        return -1;
+
+    return wb.durable;
+}
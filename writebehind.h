@@ -0,0 +1,39 @@
+#ifndef writebehind_h_INCLUDED
+#define writebehind_h_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet_size.h"
+
+// Upload data is buffered in memory and written out in chunks of this size
+#define WRITEBEHIND_BYTES (4 * PACKET_SIZE)
+
+// When the upload file is fsynced
+#define SYNC_EVERY_PACKETS 0
+#define SYNC_EVERY_BYTES   1
+#define SYNC_EVERY_MS      2
+#define SYNC_ON_FINALIZE   3
+
+#define MAX_SYNC_POLICY SYNC_ON_FINALIZE
+
+// The policy lives in memory only, so a restart falls back to the default
+#define DEFAULT_SYNC_POLICY SYNC_EVERY_BYTES
+#define DEFAULT_SYNC_VALUE  WRITEBEHIND_BYTES
+
+void writeBehindSetPolicy(uint8_t policy, uint32_t value);
+
+// Returns 0 on success, -1 with errno set on failure
+int writeBehindAppend(const char *path, const void *data, size_t len);
+int writeBehindSync(void);
+void writeBehindClose(void);
+
+// Number of bytes of the upload file known to be on stable storage
+uint64_t writeBehindDurable(void);
+
+// Make everything received so far durable, dropping anything past limit, and return the
+// length the upload continues from, -1 with errno set on failure
+int64_t writeBehindResume(const char *path, uint64_t limit);
+
+#endif // writebehind_h_INCLUDED